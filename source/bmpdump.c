@@ -8,15 +8,22 @@
  * work.  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
  *
  *
- * bmpdump is an utility to convert a 24 bit uncompressed BMP image
+ * bmpdump is an utility to convert a 24 or 32 bit uncompressed BMP image
  * to other formats.
  * 
  * Currently supported formats:
- *      1. raw (8, 12, 16, 24 bits)
- *      2. C array (8, 12, 16, 24 bits)
+ *      1. raw (1, 2, 4, 8, 12, 16, 24, 32 bits)
+ *      2. C array (1, 2, 4, 8, 12, 16, 24, 32 bits)
+ * in the pixel formats listed in PIXFMT_LIST
+ * (RGB332, RGB444, RGB565, RGB555, RGB666, RGB888, ARGB and variants,
+ * YUV 4:2:2 and 4:2:0, 1 bit pages and 2 and 4 bit gray).
  *      
- * This application uses only ANSI C functions and
- * can be compiled with most (if not all) C compilers.
+ * This application is written in C99 (it uses unsigned long long) and
+ * uses the standard C library, except for the directory functions of
+ * -scan and -watch and the file status and process id functions:
+ * <sys/stat.h>, <dirent.h> and <unistd.h> on POSIX systems, <io.h> and
+ * <windows.h> on Windows.
+ * -gamma uses pow(), link with the math library (cc bmpdump.c -lm).
  * Modifications might be needed to use this application
  * on big endian machines.
  * 
@@ -31,6 +38,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#ifndef S_ISDIR
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#endif
+#define sleep(s) Sleep((s) * 1000)
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
 
 /* constant macro's */
 #define UNSET               0
@@ -39,17 +61,35 @@
 #define APPEND              1
 #define VERBOSE             1
 #define EXISTS              1
-
-/* used to save the commandline options */ 
-struct options {
-    char *input_file;
-    char *output_file;
-    int format;
-    int bpp;
-    int append;
-    char *arrayname;
-    int verbose;
-} opts;
+#define BI_RGB              0
+#define BI_BITFIELDS        3
+#define MAX_OUTPUTS         16
+#define BYTES_PER_LINE      12
+#define ENDIAN_BIG          0
+#define ENDIAN_LITTLE       1
+#define TILE_SIZE           16
+#define CONTAINER_VERSION       1
+#define CONTAINER_HEADER_SIZE   16
+#define CONTAINER_ENTRY_SIZE    16
+#define PACKING_WORD        0
+#define PACKING_CHANNEL     1
+#define PACKING_CUSTOM      2
+#define PACKING_PAGED       3
+#define PACKING_YUV422      4
+#define PACKING_PLANAR      5
+#define PACKING_SEMIPLANAR  6
+#define PACKING_GRAY        7
+#define SELFTEST_WIDTH      1024
+#define SELFTEST_HEIGHT     512
+#define SELFTEST_SLOWDOWN   0.5
+#define LAYOUT_TILED        1
+#define LAYOUT_MORTON       2
+#define WATCH_INTERVAL      1
+#define MAX_SHARDS          64
+#define MAX_CHAR            0x10FFFF
+#define AUTO_PSNR           1
+#define AUTO_MAXERROR       2
+#define AUTO_BYTES          3
 
 /* used to save the BMP image header */
 struct bmp_header {
@@ -67,6 +107,10 @@ struct bmp_header {
     unsigned int vresolution;
     unsigned int colors;
     unsigned int important_colors;
+    unsigned int red_mask;
+    unsigned int green_mask;
+    unsigned int blue_mask;
+    unsigned int alpha_mask;
 } header;
 
 /* we use an array of pixel structures to buffer the pixel data */
@@ -74,31 +118,743 @@ struct pixel {
     unsigned char r;
     unsigned char g;
     unsigned char b;
+    unsigned char a;
+};
+
+/* describes a pixel format, see PIXFMT_LIST */
+struct pixfmt {
+    char *name;
+    int bpp;
+    char *order;        /* channel order, most significant first */
+    int bits[4];        /* bits of each channel, in channel order */
+    int unit_pixels;    /* pixels packed together */
+    int unit_bytes;     /* bytes written for unit_pixels pixels */
+    int endian;         /* byte order of multi byte pixels */
+    int packing;        /* PACKING_*, how the channels are packed */
+    char *layout;       /* description used in the C array comment */
+    int (*pack)(struct pixel *pix, int n, unsigned char *dst);  /* NULL if paged or planar */
+    int (*pack_lut)(struct pixel *pix, int n, unsigned char *dst, unsigned char (*lut)[256]);
+    int (*unpack)(unsigned char *src, int n, struct pixel *pix);    /* NULL if paged or planar */
+};
+
+/* a changed area of a frame in a sequence */
+struct rect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+};
+
+/* a glyph of a font, trimmed to its bounding box */
+struct glyph {
+    unsigned long offset;
+    unsigned int width;
+    unsigned int height;
+    unsigned int x;
+    unsigned int y;
+    unsigned int advance;
+};
+
+/* statistics of an image for -auto, gathered in one pass */
+struct analysis {
+    unsigned long hist[4][256];     /* values of each channel (LUT_r..LUT_a) */
+    unsigned long pixels;
+    unsigned long colors;           /* different RGB colors */
+    unsigned long runs;             /* runs of equal pixels within a row */
+    int alpha;                      /* nonzero if a pixel is not opaque */
+};
+
+/* an image watched for changes, see watch() */
+struct watched {
+    char *path;
+    long size;
+    time_t mtime;
+    int pending;        /* changed, converted when it stays the same for a poll */
+};
+
+/* an output file, from -out or from -format/-bpp/-of/-arrayname */
+struct output {
+    int format;
+    struct pixfmt *pixfmt;
+    char *file;
+    char *arrayname;
+    
+    /* state while writing the output */
+    FILE *fp;
+    char *tmp_file;
+    unsigned char *buf;
+    unsigned long bytes;
+    struct pixel pending[4];
+    int pending_pixels;
+    
+    /* state while writing a sequence */
+    int row_bytes;
+    unsigned char *prev;
+    unsigned char *cur;
+    struct rect *rects;
+    
+    /* lookup table of each channel (LUT_r..LUT_a), NULL if not used */
+    unsigned char (*lut)[256];
+    
+    /* ordered dithering of a gray output, the lookup table is applied
+     * while dithering (see dither_gray())
+     */
+    int dither;
+    
+    /* padded rows and banks, 0 if rows are not padded */
+    int stride;
+    int bank_rows;
+    int banks;
+    
+    /* bytes before the C array of the current bank, lines start there,
+     * and at its end, where no new line is started (0 if not banked)
+     */
+    unsigned long array_start;
+    unsigned long array_end;
+    
+    /* a C array split over files (-shards), 0 shards if not split: the
+     * header is written to header_fp, the bytes to shard_fp[shard]
+     */
+    int shards;
+    int shard;
+    long shard_bytes;
+    char *header_file;
+    FILE *header_fp;
+    char *shard_file[MAX_SHARDS];
+    char *shard_tmp[MAX_SHARDS];
+    FILE *shard_fp[MAX_SHARDS];
 };
 
+/* used to save the commandline options */ 
+struct options {
+    char *input_file;
+    char *output_file;
+    int format;
+    int bpp;
+    char *pixfmt;
+    int append;
+    char *arrayname;
+    int verbose;
+    struct output outputs[MAX_OUTPUTS];
+    int num_outputs;
+    char *sequence;
+    int frames;
+    int first_frame;
+    int keyframe;
+    int threshold;
+    int dither;
+    int premultiply;
+    double gamma[3];
+    char *lut_file;
+    unsigned char *lut_table;
+    int round;
+    int stride;
+    int array_align;
+    int constant;
+    char *section;
+    long bank_size;
+    char *font;
+    unsigned int cell_width;
+    unsigned int cell_height;
+    int chars;
+    long first_char;
+    long last_char;
+    int glyph_bits;
+    int proportional;
+    int spacing;
+    int selftest;
+    char *baseline;
+    char *save_baseline;
+    char *container;
+    int align;
+    char *check;
+    char *scan;
+    int json;
+    int auto_mode;
+    double auto_limit;
+    int layout;
+    unsigned int tile_width;
+    unsigned int tile_height;
+    char *watch;
+    int watch_dir;
+    char *unpack;
+    unsigned int unpack_width;
+    unsigned int unpack_height;
+    int shards;
+} opts;
+
 /* forward declarations */
 int parse_opts(int argc, char* argv[], struct options * opts);
-int get_header(FILE *fp, struct bmp_header *h);
+int parse_output(char *spec, struct output *out);
+int is_identifier(char *s);
+int get_header(FILE *fp, struct bmp_header *h, char **error);
 void get_data(FILE *fp, struct pixel *pixbuf, struct bmp_header *h);
-int create_c_array_8bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h);
-int create_c_array_12bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h);
-int create_c_array_16bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h);
-int create_c_array_24bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h);
-int create_raw_8bit(struct pixel *buf, int pixels, struct options *o);
-int create_raw_12bit(struct pixel *buf, int pixels, struct options *o);
-int create_raw_16bit(struct pixel *buf, int pixels, struct options *o);
-int create_raw_24bit(struct pixel *buf, int pixels, struct options *o);
+void premultiply(struct pixel *pixbuf, int n);
+struct pixel *read_bmp(char *file, struct bmp_header *h);
+int pack_rgb444(struct pixel *pix, int n, unsigned char *dst);
+int packlut_rgb444(struct pixel *pix, int n, unsigned char *dst, unsigned char (*lut)[256]);
+int unpack_rgb444(unsigned char *src, int n, struct pixel *pix);
+void yuv_to_rgb(int y, int u, int v, struct pixel *p);
+struct pixfmt *find_pixfmt(char *name);
+int open_output(struct output *out, struct options *o, struct bmp_header *h, int pixels);
+void write_output(struct output *out, struct pixel *pix, int n);
+int pack_output(struct output *out, struct pixel *pix, int n, unsigned char *dst);
+int build_lut(struct output *out, struct options *o);
+void emit_bytes(struct output *out, unsigned char *data, int len, int partial);
+int close_output(struct output *out, struct options *o, int ok);
+void begin_array(struct output *out, struct options *o, char *name, int bank);
+long plan_shards(struct output *out, struct options *o, struct bmp_header *h);
+int open_shards(struct output *out, struct options *o, long total);
+int close_shards(struct output *out, int ok);
+unsigned long image_size(struct pixfmt *f, unsigned int width, unsigned int height);
+void macro_name(char *dst, char *name, int size);
+void end_row(struct output *out, struct options *o, unsigned int line, unsigned int height);
+int create_outputs(struct pixel *buf, struct options *o, struct bmp_header *h);
+int write_tiles(struct pixel *buf, struct options *o, struct bmp_header *h);
+unsigned long long transpose8(unsigned long long x);
+int write_pages(struct output *out, struct pixel *buf, struct bmp_header *h, struct options *o);
+void dither_gray(struct output *out, struct pixel *src, struct pixel *dst, unsigned int x, unsigned int y);
+int write_planes(struct output *out, struct pixel *buf, struct bmp_header *h);
+unsigned long packed_size(struct pixfmt *f, unsigned long n);
+int row_aligned(struct pixfmt *f);
+void write_row(struct output *out, struct pixel *pix, int n);
+void flush_output(struct output *out);
+void emit_u16(struct output *out, unsigned int v);
+int find_dirty_rects(struct pixfmt *f, unsigned char *prev, unsigned char *cur,
+                     unsigned int w, unsigned int h, struct rect *rects);
+struct pixel *read_frame(struct options *o, int frame, struct bmp_header *h);
+int create_sequence(struct options *o);
+int is_sequence_pattern(char *pattern);
+void put_u16(FILE *fp, unsigned int v);
+void put_u32(FILE *fp, unsigned long v);
+unsigned int get_u16(unsigned char *b);
+unsigned long get_u32(unsigned char *b);
+struct pixfmt *default_pixfmt(struct options *o);
+int create_container(struct options *o);
+int check_container(char *file);
+unsigned int glyph_value(struct pixel *p, struct pixel *bg, struct options *o);
+int create_font(struct options *o);
+char **list_dir(char *dir, int *n);
+int compare_names(const void *a, const void *b);
+void print_json_string(char *s);
+int scan_file(char *path, long file_size, unsigned long *totals, int first, struct options *o);
+int scan_dir(char *dir, unsigned long *totals, int *files, struct options *o);
+int scan(struct options *o);
+FILE *open_replace(char *file, char *mode, char **tmp);
+int close_replace(FILE *fp, char *file, char *tmp, int ok);
+int convert(struct options *o);
+char *output_path(char *path, struct options *o);
+char *base_name(char *path);
+int convert_watched(char *path, struct options *o);
+void watch_file(char *path, struct watched **files, int *n, int first, struct options *o);
+void watch_tree(char *dir, struct watched **files, int *n, int first, struct options *o);
+int watch(struct options *o);
+int analyze_image(struct pixel *buf, struct bmp_header *h, struct analysis *a);
+double quantize_error(struct analysis *a, struct pixfmt *f, int round, int *max_error);
+int auto_pixfmt(struct pixel *buf, struct bmp_header *h, struct options *o);
+unsigned char *parse_carray(char *text, long *len, struct bmp_header *h, struct pixfmt **f, int *stride);
+long row_offset(unsigned int y, int stride, int bank_rows, long bank_size);
+struct pixel *unpack_image(unsigned char *data, long len, struct pixfmt *f, struct bmp_header *h,
+                           int stride, int bank_rows, long bank_size);
+long compare_packed(unsigned char *data, struct pixel *orig, struct pixfmt *f, struct bmp_header *h,
+                    int stride, int bank_rows, long bank_size, struct options *o);
+int unpack(struct options *o);
+int write_bmp(char *file, struct pixel *buf, unsigned int w, unsigned int h, int bpp);
+unsigned char *read_file(char *file, long *len);
+void ref_put(FILE *fp, int carray, unsigned char b);
+void ref_create(FILE *fp, int carray, int bpp, struct pixel *buf, struct bmp_header *h, char *name);
+long ref_pack(struct pixfmt *f, struct pixel *buf, struct bmp_header *h, unsigned char *dst, struct options *o);
+int selftest_compare(char *file, unsigned char *exp, long len, char *what);
+double selftest_speed(struct pixfmt *f, struct pixel *buf, struct bmp_header *h,
+                      unsigned char *dst, int ref, struct options *o);
+int selftest_throughput(struct options *o);
+int selftest(struct options *o);
+int selftest_path(char *path, char *ext);
 void print_options(struct options *o);
 void print_header(struct bmp_header *h);
 void print_help(void);
 
+/* Pixel formats.
+ *
+ * Every pixel format is described once in this list. The list is
+ * expanded twice: once to generate the packing functions of each format
+ * and once to build the pixfmts[] descriptor table. Every format has a
+ * plain packing function and one that reads the channels through the
+ * lookup table of the output (gamma, calibration and rounding), and an
+ * unpacking function for -unpack. The channel order,
+ * bit widths, bytes per pixel and byte order are compile time constants
+ * in every generated function, so each format gets its own tight loop.
+ *
+ * PACKED:   the channels are packed into one word of 'bytes' bytes,
+ *           first channel in the most significant bits.
+ * ALIGNED:  every channel is written MSB aligned in its own byte.
+ * PACKED4, ALIGNED4: the same with a fourth channel, for alpha.
+ * CUSTOM:   hand written (un)packing functions, for units of several pixels.
+ * YUV422:   two pixels in four bytes, the Y of each and the U and V of
+ *           both, at the byte offsets y0, u, y1 and v.
+ * PAGED:    1 bit per pixel in pages of 8 lines, see write_pages().
+ *           This is not a pixel stream and has no packing function.
+ * PLANAR:   YUV 4:2:0, a Y plane and U and V planes (PACKING_PLANAR) or
+ *           one plane of UV pairs (PACKING_SEMIPLANAR), see write_planes().
+ *           No pixel stream either.
+ * GRAY:     luminance with 2 or 4 bits, 8 / bpp pixels in a byte. The
+ *           endian is the bit order: ENDIAN_BIG puts the first pixel in
+ *           the high bits. -dither dithers it, see dither_gray().
+ *
+ * YUV is BT.601 studio range (Y 16..235, U and V 16..240), U and V
+ * of the average of the pixels that share them.
+ *
+ * The first format of each bpp is used for -bpp. New formats are added
+ * at the end, containers store the position of the format in this list.
+ */
+#define PIXFMT_LIST \
+    PACKED  (rgb332,   8,  r, g, b, 3, 3, 2, 1, ENDIAN_BIG,    "8 bits (RRRGGGBB)") \
+    PACKED  (bgr233,   8,  b, g, r, 2, 3, 3, 1, ENDIAN_BIG,    "8 bits (BBGGGRRR)") \
+    CUSTOM  (rgb444,   12, r, g, b, 4, 4, 4, 2, 3, ENDIAN_BIG, "12 bits, two pixels share three bytes (RRRRGGGG BBBBRRRR GGGGBBBB)", pack_rgb444, packlut_rgb444, unpack_rgb444) \
+    PACKED  (rgb565,   16, r, g, b, 5, 6, 5, 2, ENDIAN_BIG,    "16 bits (RRRRRGGG GGGBBBBB)") \
+    PACKED  (rgb565le, 16, r, g, b, 5, 6, 5, 2, ENDIAN_LITTLE, "16 bits, little endian (GGGBBBBB RRRRRGGG)") \
+    PACKED  (bgr565,   16, b, g, r, 5, 6, 5, 2, ENDIAN_BIG,    "16 bits (BBBBBGGG GGGRRRRR)") \
+    PACKED  (rgb555,   16, r, g, b, 5, 5, 5, 2, ENDIAN_BIG,    "16 bits (0RRRRRGG GGGBBBBB)") \
+    ALIGNED (rgb888,   24, r, g, b, 8, 8, 8,                   "24 bits (RRRRRRRR GGGGGGGG BBBBBBBB)") \
+    ALIGNED (bgr888,   24, b, g, r, 8, 8, 8,                   "24 bits (BBBBBBBB GGGGGGGG RRRRRRRR)") \
+    ALIGNED (rgb666,   24, r, g, b, 6, 6, 6,                   "18 bits in three bytes (RRRRRR00 GGGGGG00 BBBBBB00)") \
+    PAGED   (ssd1306,  1,                                      "1 bit, pages of 8 lines, one byte per column, top line in bit 0 (SSD1306)") \
+    PACKED4 (argb4444, 16, a, r, g, b, 4, 4, 4, 4, 2, ENDIAN_BIG, "16 bits with alpha (AAAARRRR GGGGBBBB)") \
+    PACKED4 (argb8565, 24, a, r, g, b, 8, 5, 6, 5, 3, ENDIAN_BIG, "24 bits with alpha (AAAAAAAA RRRRRGGG GGGBBBBB)") \
+    ALIGNED4(rgba8888, 32, r, g, b, a, 8, 8, 8, 8,                "32 bits with alpha (RRRRRRRR GGGGGGGG BBBBBBBB AAAAAAAA)") \
+    ALIGNED4(argb8888, 32, a, r, g, b, 8, 8, 8, 8,                "32 bits with alpha (AAAAAAAA RRRRRRRR GGGGGGGG BBBBBBBB)") \
+    YUV422  (yuyv,     "yuyv", 0, 1, 2, 3,                     "16 bits, two pixels share four bytes (YYYYYYYY UUUUUUUU YYYYYYYY VVVVVVVV)") \
+    YUV422  (uyvy,     "uyvy", 1, 0, 3, 2,                     "16 bits, two pixels share four bytes (UUUUUUUU YYYYYYYY VVVVVVVV YYYYYYYY)") \
+    PLANAR  (i420,     PACKING_PLANAR,                         "12 bits, YUV 4:2:0: a Y plane, then a U and a V plane of half width and height (I420)") \
+    PLANAR  (nv12,     PACKING_SEMIPLANAR,                     "12 bits, YUV 4:2:0: a Y plane, then a plane of UV pairs of half width and height (NV12)") \
+    GRAY    (gray2,    2, ENDIAN_BIG,                          "2 bits gray, four pixels per byte, the first in the high bits (00112233)") \
+    GRAY    (gray2lsb, 2, ENDIAN_LITTLE,                       "2 bits gray, four pixels per byte, the first in the low bits (33221100)") \
+    GRAY    (gray4,    4, ENDIAN_BIG,                          "4 bits gray, two pixels per byte, the first in the high bits (00001111)") \
+    GRAY    (gray4lsb, 4, ENDIAN_LITTLE,                       "4 bits gray, two pixels per byte, the first in the low bits (11110000)")
+
+/* store a packed word of 'bytes' bytes */
+#define STORE_WORD(d, v, bytes, endian) \
+    { \
+        if (bytes == 1) { \
+            (d)[0] = (unsigned char)v; \
+        } else if (bytes == 2 && endian == ENDIAN_BIG) { \
+            (d)[0] = (unsigned char)(v >> 8); \
+            (d)[1] = (unsigned char)v; \
+        } else if (bytes == 2) { \
+            (d)[0] = (unsigned char)v; \
+            (d)[1] = (unsigned char)(v >> 8); \
+        } else if (endian == ENDIAN_BIG) { \
+            (d)[0] = (unsigned char)(v >> 16); \
+            (d)[1] = (unsigned char)(v >> 8); \
+            (d)[2] = (unsigned char)v; \
+        } else { \
+            (d)[0] = (unsigned char)v; \
+            (d)[1] = (unsigned char)(v >> 8); \
+            (d)[2] = (unsigned char)(v >> 16); \
+        } \
+    }
+
+/* channel c of pixel p: as it is, or through the lookup table of the
+ * output, which also holds the quantization (see build_lut()).
+ * The table rows are indexed by the channel name.
+ */
+#define LUT_r 0
+#define LUT_g 1
+#define LUT_b 2
+#define LUT_a 3
+#define GET_PIXEL(p, c) ((p)->c)
+#define GET_LUT(p, c)   (lut[LUT_##c][(p)->c])
+
+/* pack one pixel of a PACKED format */
+#define PACK_WORD(get, p, d, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    { \
+        unsigned long v = ((unsigned long)(get(p, c0) >> (8-b0)) << (b1+b2)) \
+                        | ((unsigned long)(get(p, c1) >> (8-b1)) << b2) \
+                        | (get(p, c2) >> (8-b2)); \
+        STORE_WORD(d, v, bytes, endian) \
+    }
+
+/* pack one pixel of a PACKED4 format */
+#define PACK_WORD4(get, p, d, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    { \
+        unsigned long v = ((unsigned long)(get(p, c0) >> (8-b0)) << (b1+b2+b3)) \
+                        | ((unsigned long)(get(p, c1) >> (8-b1)) << (b2+b3)) \
+                        | ((unsigned long)(get(p, c2) >> (8-b2)) << b3) \
+                        | (get(p, c3) >> (8-b3)); \
+        STORE_WORD(d, v, bytes, endian) \
+    }
+
+/* pack one pixel of an ALIGNED format */
+#define PACK_CHANNELS(get, p, d, c0, c1, c2, b0, b1, b2) \
+    { \
+        (d)[0] = get(p, c0) & (0xFF << (8-b0)); \
+        (d)[1] = get(p, c1) & (0xFF << (8-b1)); \
+        (d)[2] = get(p, c2) & (0xFF << (8-b2)); \
+    }
+
+/* pack one pixel of an ALIGNED4 format */
+#define PACK_CHANNELS4(get, p, d, c0, c1, c2, c3, b0, b1, b2, b3) \
+    { \
+        (d)[0] = get(p, c0) & (0xFF << (8-b0)); \
+        (d)[1] = get(p, c1) & (0xFF << (8-b1)); \
+        (d)[2] = get(p, c2) & (0xFF << (8-b2)); \
+        (d)[3] = get(p, c3) & (0xFF << (8-b3)); \
+    }
+
+/* BT.601 studio range Y of a pixel, and U and V of the sum of 2^shift
+ * pixels. The offset keeps the sum positive before the shift.
+ */
+#define YUV_Y(r, g, b)          (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define YUV_U(r, g, b, shift)   ((-38 * (r) - 74 * (g) + 112 * (b) + (257 << (7 + (shift)))) >> (8 + (shift)))
+#define YUV_V(r, g, b, shift)   ((112 * (r) - 94 * (g) - 18 * (b) + (257 << (7 + (shift)))) >> (8 + (shift)))
+
+/* packing function bodies, four pixels per loop iteration */
+#define PACKED_KERNEL(fn, params, get, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    int fn params \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, dst += 4*bytes) { \
+            PACK_WORD(get, pix,   dst,           c0, c1, c2, b0, b1, b2, bytes, endian) \
+            PACK_WORD(get, pix+1, dst + bytes,   c0, c1, c2, b0, b1, b2, bytes, endian) \
+            PACK_WORD(get, pix+2, dst + 2*bytes, c0, c1, c2, b0, b1, b2, bytes, endian) \
+            PACK_WORD(get, pix+3, dst + 3*bytes, c0, c1, c2, b0, b1, b2, bytes, endian) \
+        } \
+        for (; i < n; i++, pix++, dst += bytes) { \
+            PACK_WORD(get, pix, dst, c0, c1, c2, b0, b1, b2, bytes, endian) \
+        } \
+        return n * bytes; \
+    }
+#define ALIGNED_KERNEL(fn, params, get, c0, c1, c2, b0, b1, b2) \
+    int fn params \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, dst += 12) { \
+            PACK_CHANNELS(get, pix,   dst,     c0, c1, c2, b0, b1, b2) \
+            PACK_CHANNELS(get, pix+1, dst + 3, c0, c1, c2, b0, b1, b2) \
+            PACK_CHANNELS(get, pix+2, dst + 6, c0, c1, c2, b0, b1, b2) \
+            PACK_CHANNELS(get, pix+3, dst + 9, c0, c1, c2, b0, b1, b2) \
+        } \
+        for (; i < n; i++, pix++, dst += 3) { \
+            PACK_CHANNELS(get, pix, dst, c0, c1, c2, b0, b1, b2) \
+        } \
+        return n * 3; \
+    }
+#define PACKED4_KERNEL(fn, params, get, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    int fn params \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, dst += 4*bytes) { \
+            PACK_WORD4(get, pix,   dst,           c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            PACK_WORD4(get, pix+1, dst + bytes,   c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            PACK_WORD4(get, pix+2, dst + 2*bytes, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            PACK_WORD4(get, pix+3, dst + 3*bytes, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+        } \
+        for (; i < n; i++, pix++, dst += bytes) { \
+            PACK_WORD4(get, pix, dst, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+        } \
+        return n * bytes; \
+    }
+#define ALIGNED4_KERNEL(fn, params, get, c0, c1, c2, c3, b0, b1, b2, b3) \
+    int fn params \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, dst += 16) { \
+            PACK_CHANNELS4(get, pix,   dst,      c0, c1, c2, c3, b0, b1, b2, b3) \
+            PACK_CHANNELS4(get, pix+1, dst + 4,  c0, c1, c2, c3, b0, b1, b2, b3) \
+            PACK_CHANNELS4(get, pix+2, dst + 8,  c0, c1, c2, c3, b0, b1, b2, b3) \
+            PACK_CHANNELS4(get, pix+3, dst + 12, c0, c1, c2, c3, b0, b1, b2, b3) \
+        } \
+        for (; i < n; i++, pix++, dst += 4) { \
+            PACK_CHANNELS4(get, pix, dst, c0, c1, c2, c3, b0, b1, b2, b3) \
+        } \
+        return n * 4; \
+    }
+
+/* two pixels per loop iteration, the chroma of both in the same pass.
+ * A last single pixel is repeated to fill its macropixel.
+ */
+#define YUV422_KERNEL(fn, params, get, y0, u, y1, v) \
+    int fn params \
+    { \
+        int i, sr, sg, sb; \
+        for (i = 0; (i+2) <= n; i += 2, pix += 2, dst += 4) { \
+            sr = get(pix, r) + get(pix+1, r); \
+            sg = get(pix, g) + get(pix+1, g); \
+            sb = get(pix, b) + get(pix+1, b); \
+            dst[y0] = YUV_Y(get(pix, r), get(pix, g), get(pix, b)); \
+            dst[y1] = YUV_Y(get(pix+1, r), get(pix+1, g), get(pix+1, b)); \
+            dst[u]  = YUV_U(sr, sg, sb, 1); \
+            dst[v]  = YUV_V(sr, sg, sb, 1); \
+        } \
+        if (i < n) { \
+            sr = 2 * get(pix, r); \
+            sg = 2 * get(pix, g); \
+            sb = 2 * get(pix, b); \
+            dst[y0] = dst[y1] = YUV_Y(get(pix, r), get(pix, g), get(pix, b)); \
+            dst[u]  = YUV_U(sr, sg, sb, 1); \
+            dst[v]  = YUV_V(sr, sg, sb, 1); \
+            return (n / 2) * 4 + 4; \
+        } \
+        return n * 2; \
+    }
+
+/* luminance of a pixel, the weights add up to 256 */
+#define GRAY_Y(get, p)  ((77 * get(p, r) + 150 * get(p, g) + 29 * get(p, b)) >> 8)
+
+/* shift of the k-th pixel in a byte of gray pixels */
+#define GRAY_SHIFT(k, bits, endian) \
+    ((endian) == ENDIAN_BIG ? 8 - (bits) * ((k) + 1) : (bits) * (k))
+
+/* eight pixels per loop iteration: the luminance of all of them, then
+ * the bytes. The missing pixels of a last partial byte are zero.
+ */
+#define GRAY_KERNEL(fn, params, get, bits, endian) \
+    int fn params \
+    { \
+        int i, j, k; \
+        unsigned int y[8]; \
+        unsigned char *d = dst; \
+        for (i = 0; (i+8) <= n; i += 8, pix += 8) { \
+            for (k = 0; k < 8; k++) y[k] = GRAY_Y(get, pix + k) >> (8 - bits); \
+            for (k = 0; k < 8; k += 8 / bits, d++) { \
+                *d = 0; \
+                for (j = 0; j < 8 / bits; j++) *d |= y[k + j] << GRAY_SHIFT(j, bits, endian); \
+            } \
+        } \
+        for (; i < n; i += 8 / bits, d++) { \
+            *d = 0; \
+            for (j = 0; j < 8 / bits && i + j < n; j++, pix++) { \
+                *d |= (GRAY_Y(get, pix) >> (8 - bits)) << GRAY_SHIFT(j, bits, endian); \
+            } \
+        } \
+        return d - dst; \
+    }
+
+/* load a packed word of 'bytes' bytes */
+#define LOAD_WORD(s, bytes, endian) \
+    ((bytes) == 1 ? (unsigned long)(s)[0] \
+     : ((bytes) == 2 && (endian) == ENDIAN_BIG) ? ((unsigned long)(s)[0] << 8) | (s)[1] \
+     : ((bytes) == 2) ? ((unsigned long)(s)[1] << 8) | (s)[0] \
+     : ((endian) == ENDIAN_BIG) ? ((unsigned long)(s)[0] << 16) | ((unsigned long)(s)[1] << 8) | (s)[2] \
+     : ((unsigned long)(s)[2] << 16) | ((unsigned long)(s)[1] << 8) | (s)[0])
+
+/* a channel of b bits expanded to 8 bits, as a display does */
+#define EXPAND(v, b)    (((v) * 255 + ((1 << (b)) - 1) / 2) / ((1 << (b)) - 1))
+
+/* unpack one pixel of a PACKED format, opaque */
+#define UNPACK_WORD(s, p, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    { \
+        unsigned long v = LOAD_WORD(s, bytes, endian); \
+        (p)->c0 = EXPAND((v >> (b1+b2)) & ((1 << b0) - 1), b0); \
+        (p)->c1 = EXPAND((v >> b2) & ((1 << b1) - 1), b1); \
+        (p)->c2 = EXPAND(v & ((1 << b2) - 1), b2); \
+        (p)->a = 255; \
+    }
+
+/* unpack one pixel of a PACKED4 format */
+#define UNPACK_WORD4(s, p, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    { \
+        unsigned long v = LOAD_WORD(s, bytes, endian); \
+        (p)->c0 = EXPAND((v >> (b1+b2+b3)) & ((1 << b0) - 1), b0); \
+        (p)->c1 = EXPAND((v >> (b2+b3)) & ((1 << b1) - 1), b1); \
+        (p)->c2 = EXPAND((v >> b3) & ((1 << b2) - 1), b2); \
+        (p)->c3 = EXPAND(v & ((1 << b3) - 1), b3); \
+    }
+
+/* unpack one pixel of an ALIGNED format, opaque */
+#define UNPACK_CHANNELS(s, p, c0, c1, c2, b0, b1, b2) \
+    { \
+        (p)->c0 = EXPAND((s)[0] >> (8-b0), b0); \
+        (p)->c1 = EXPAND((s)[1] >> (8-b1), b1); \
+        (p)->c2 = EXPAND((s)[2] >> (8-b2), b2); \
+        (p)->a = 255; \
+    }
+
+/* unpack one pixel of an ALIGNED4 format */
+#define UNPACK_CHANNELS4(s, p, c0, c1, c2, c3, b0, b1, b2, b3) \
+    { \
+        (p)->c0 = EXPAND((s)[0] >> (8-b0), b0); \
+        (p)->c1 = EXPAND((s)[1] >> (8-b1), b1); \
+        (p)->c2 = EXPAND((s)[2] >> (8-b2), b2); \
+        (p)->c3 = EXPAND((s)[3] >> (8-b3), b3); \
+    }
+
+/* unpacking function bodies, the inverse of the packing functions,
+ * four pixels per loop iteration. They return the bytes read.
+ */
+#define UNPACKED_KERNEL(fn, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, src += 4*bytes) { \
+            UNPACK_WORD(src,           pix,   c0, c1, c2, b0, b1, b2, bytes, endian) \
+            UNPACK_WORD(src + bytes,   pix+1, c0, c1, c2, b0, b1, b2, bytes, endian) \
+            UNPACK_WORD(src + 2*bytes, pix+2, c0, c1, c2, b0, b1, b2, bytes, endian) \
+            UNPACK_WORD(src + 3*bytes, pix+3, c0, c1, c2, b0, b1, b2, bytes, endian) \
+        } \
+        for (; i < n; i++, pix++, src += bytes) { \
+            UNPACK_WORD(src, pix, c0, c1, c2, b0, b1, b2, bytes, endian) \
+        } \
+        return n * bytes; \
+    }
+#define UNALIGNED_KERNEL(fn, c0, c1, c2, b0, b1, b2) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, src += 12) { \
+            UNPACK_CHANNELS(src,     pix,   c0, c1, c2, b0, b1, b2) \
+            UNPACK_CHANNELS(src + 3, pix+1, c0, c1, c2, b0, b1, b2) \
+            UNPACK_CHANNELS(src + 6, pix+2, c0, c1, c2, b0, b1, b2) \
+            UNPACK_CHANNELS(src + 9, pix+3, c0, c1, c2, b0, b1, b2) \
+        } \
+        for (; i < n; i++, pix++, src += 3) { \
+            UNPACK_CHANNELS(src, pix, c0, c1, c2, b0, b1, b2) \
+        } \
+        return n * 3; \
+    }
+#define UNPACKED4_KERNEL(fn, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, src += 4*bytes) { \
+            UNPACK_WORD4(src,           pix,   c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            UNPACK_WORD4(src + bytes,   pix+1, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            UNPACK_WORD4(src + 2*bytes, pix+2, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+            UNPACK_WORD4(src + 3*bytes, pix+3, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+        } \
+        for (; i < n; i++, pix++, src += bytes) { \
+            UNPACK_WORD4(src, pix, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+        } \
+        return n * bytes; \
+    }
+#define UNALIGNED4_KERNEL(fn, c0, c1, c2, c3, b0, b1, b2, b3) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        for (i = 0; (i+4) <= n; i += 4, pix += 4, src += 16) { \
+            UNPACK_CHANNELS4(src,      pix,   c0, c1, c2, c3, b0, b1, b2, b3) \
+            UNPACK_CHANNELS4(src + 4,  pix+1, c0, c1, c2, c3, b0, b1, b2, b3) \
+            UNPACK_CHANNELS4(src + 8,  pix+2, c0, c1, c2, c3, b0, b1, b2, b3) \
+            UNPACK_CHANNELS4(src + 12, pix+3, c0, c1, c2, c3, b0, b1, b2, b3) \
+        } \
+        for (; i < n; i++, pix++, src += 4) { \
+            UNPACK_CHANNELS4(src, pix, c0, c1, c2, c3, b0, b1, b2, b3) \
+        } \
+        return n * 4; \
+    }
+#define YUV422_UNPACK_KERNEL(fn, y0, u, y1, v) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        for (i = 0; (i+2) <= n; i += 2, pix += 2, src += 4) { \
+            yuv_to_rgb(src[y0], src[u], src[v], pix); \
+            yuv_to_rgb(src[y1], src[u], src[v], pix+1); \
+        } \
+        if (i < n) { \
+            yuv_to_rgb(src[y0], src[u], src[v], pix); \
+            return (n / 2) * 4 + 4; \
+        } \
+        return n * 2; \
+    }
+
+#define GRAY_UNPACK_KERNEL(fn, bits, endian) \
+    int fn UNPACK_PARAMS \
+    { \
+        int i; \
+        unsigned int v; \
+        for (i = 0; i < n; i++, pix++) { \
+            v = (src[i / (8 / bits)] >> GRAY_SHIFT(i % (8 / bits), bits, endian)) & ((1 << bits) - 1); \
+            pix->r = pix->g = pix->b = EXPAND(v, bits); \
+            pix->a = 255; \
+        } \
+        return (n * bits + 7) / 8; \
+    }
+
+#define PACK_PARAMS     (struct pixel *pix, int n, unsigned char *dst)
+#define PACKLUT_PARAMS  (struct pixel *pix, int n, unsigned char *dst, unsigned char (*lut)[256])
+#define UNPACK_PARAMS   (unsigned char *src, int n, struct pixel *pix)
+
+/* generate the packing functions, pack_<name>() and packlut_<name>(),
+ * and the unpacking function unpack_<name>()
+ */
+#define PACKED(name, bpp, c0, c1, c2, b0, b1, b2, bytes, endian, layout) \
+    PACKED_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    PACKED_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, c0, c1, c2, b0, b1, b2, bytes, endian) \
+    UNPACKED_KERNEL(unpack_##name, c0, c1, c2, b0, b1, b2, bytes, endian)
+#define ALIGNED(name, bpp, c0, c1, c2, b0, b1, b2, layout) \
+    ALIGNED_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, c0, c1, c2, b0, b1, b2) \
+    ALIGNED_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, c0, c1, c2, b0, b1, b2) \
+    UNALIGNED_KERNEL(unpack_##name, c0, c1, c2, b0, b1, b2)
+#define PACKED4(name, bpp, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian, layout) \
+    PACKED4_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    PACKED4_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian) \
+    UNPACKED4_KERNEL(unpack_##name, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian)
+#define ALIGNED4(name, bpp, c0, c1, c2, c3, b0, b1, b2, b3, layout) \
+    ALIGNED4_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, c0, c1, c2, c3, b0, b1, b2, b3) \
+    ALIGNED4_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, c0, c1, c2, c3, b0, b1, b2, b3) \
+    UNALIGNED4_KERNEL(unpack_##name, c0, c1, c2, c3, b0, b1, b2, b3)
+#define YUV422(name, order, y0, u, y1, v, layout) \
+    YUV422_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, y0, u, y1, v) \
+    YUV422_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, y0, u, y1, v) \
+    YUV422_UNPACK_KERNEL(unpack_##name, y0, u, y1, v)
+#define GRAY(name, bpp, endian, layout) \
+    GRAY_KERNEL(pack_##name, PACK_PARAMS, GET_PIXEL, bpp, endian) \
+    GRAY_KERNEL(packlut_##name, PACKLUT_PARAMS, GET_LUT, bpp, endian) \
+    GRAY_UNPACK_KERNEL(unpack_##name, bpp, endian)
+#define CUSTOM(name, bpp, c0, c1, c2, b0, b1, b2, upix, ubytes, endian, layout, fn, fnlut, fnunpack)
+#define PAGED(name, bpp, layout)
+#define PLANAR(name, packing, layout)
+
+PIXFMT_LIST
+
+#undef PACKED
+#undef ALIGNED
+#undef PACKED4
+#undef ALIGNED4
+#undef YUV422
+#undef GRAY
+#undef CUSTOM
+#undef PAGED
+#undef PLANAR
+
+/* generate the pixel format descriptor table */
+#define PACKED(name, bpp, c0, c1, c2, b0, b1, b2, bytes, endian, layout) \
+    { #name, bpp, #c0 #c1 #c2, { b0, b1, b2 }, 1, bytes, endian, PACKING_WORD, layout, pack_##name, packlut_##name, unpack_##name },
+#define ALIGNED(name, bpp, c0, c1, c2, b0, b1, b2, layout) \
+    { #name, bpp, #c0 #c1 #c2, { b0, b1, b2 }, 1, 3, ENDIAN_BIG, PACKING_CHANNEL, layout, pack_##name, packlut_##name, unpack_##name },
+#define PACKED4(name, bpp, c0, c1, c2, c3, b0, b1, b2, b3, bytes, endian, layout) \
+    { #name, bpp, #c0 #c1 #c2 #c3, { b0, b1, b2, b3 }, 1, bytes, endian, PACKING_WORD, layout, pack_##name, packlut_##name, unpack_##name },
+#define ALIGNED4(name, bpp, c0, c1, c2, c3, b0, b1, b2, b3, layout) \
+    { #name, bpp, #c0 #c1 #c2 #c3, { b0, b1, b2, b3 }, 1, 4, ENDIAN_BIG, PACKING_CHANNEL, layout, pack_##name, packlut_##name, unpack_##name },
+#define CUSTOM(name, bpp, c0, c1, c2, b0, b1, b2, upix, ubytes, endian, layout, fn, fnlut, fnunpack) \
+    { #name, bpp, #c0 #c1 #c2, { b0, b1, b2 }, upix, ubytes, endian, PACKING_CUSTOM, layout, fn, fnlut, fnunpack },
+#define YUV422(name, order, y0, u, y1, v, layout) \
+    { #name, 16, order, { 8, 8, 8, 8 }, 2, 4, ENDIAN_BIG, PACKING_YUV422, layout, pack_##name, packlut_##name, unpack_##name },
+#define PAGED(name, bpp, layout) \
+    { #name, bpp, "y", { 1, 0, 0 }, 8, 1, ENDIAN_BIG, PACKING_PAGED, layout, NULL, NULL, NULL },
+#define PLANAR(name, packing, layout) \
+    { #name, 12, "yuv", { 8, 8, 8 }, 4, 6, ENDIAN_BIG, packing, layout, NULL, NULL, NULL },
+#define GRAY(name, bpp, endian, layout) \
+    { #name, bpp, "y", { bpp, 0, 0 }, 8 / bpp, 1, endian, PACKING_GRAY, layout, pack_##name, packlut_##name, unpack_##name },
+
+struct pixfmt pixfmts[] = {
+    PIXFMT_LIST
+};
+
+#undef PACKED
+#undef ALIGNED
+#undef PACKED4
+#undef ALIGNED4
+#undef YUV422
+#undef GRAY
+#undef CUSTOM
+#undef PAGED
+#undef PLANAR
+
+#define NUM_PIXFMTS ((int)(sizeof(pixfmts) / sizeof(pixfmts[0])))
+
 int main(int argc, char *argv[])
 {
-    FILE *fp;
-    int i, pixels;
-    struct pixel * pixbuf;
-    int pixbufsize;
-    
     /* parse command line options */
     if (! parse_opts(argc, argv, &opts)) {
         return 1;
@@ -106,94 +862,106 @@ int main(int argc, char *argv[])
     
     if (opts.verbose == VERBOSE) print_options(&opts);
     
+    /* check the packing functions, no conversion */
+    if (opts.selftest) {
+        return selftest(&opts) ? 0 : 1;
+    }
+    
+    /* check a container, no conversion */
+    if (opts.check != NULL) {
+        return check_container(opts.check) ? 0 : 1;
+    }
+    
+    /* scan a directory, no conversion */
+    if (opts.scan != NULL) {
+        return scan(&opts) ? 0 : 1;
+    }
+    
+    /* unpack an output to a preview, no conversion */
+    if (opts.unpack != NULL) {
+        return unpack(&opts) ? 0 : 1;
+    }
+    
+    /* convert again whenever the input changes */
+    if (opts.watch != NULL) {
+        return watch(&opts) ? 0 : 1;
+    }
+    
+    return convert(&opts) ? 0 : 1;
+}
+
+/* Read a BMP image into a newly allocated pixel buffer
+ * 
+ * Arguments:   file:   path of the BMP image
+ *              h:      pointer to bmp_header structure to save the header in
+ * 
+ * Return:      pointer to pixel buffer or NULL if reading failed
+ */
+struct pixel *read_bmp(char *file, struct bmp_header *h)
+{
+    FILE *fp;
+    int pixels;
+    struct pixel * pixbuf;
+    int pixbufsize;
+    char *error;
+    
     /* open BMP image file */   
-    fp = fopen(opts.input_file, "rb+");
+    fp = fopen(file, "rb");
     
     if (fp == NULL) {
-        printf("Failed to open file...\n");
-        return 1;
+        printf("Failed to open file %s\n", file);
+        return NULL;
     }
     
     /* get the BMP image header */
-    if (! get_header(fp, &header)) return 1;
-    if (opts.verbose == VERBOSE) print_header(&header);
+    if (! get_header(fp, h, &error)) {
+        printf("%s\n", error);
+        fclose(fp);
+        return NULL;
+    }
+    
+    if (opts.verbose == VERBOSE) print_header(h);
     
     /* calculate number of pixels in the image */
-    pixels = header.width * header.height;
+    pixels = h->width * h->height;
     
     /* allocate memory for pixel buffer */
-    pixbufsize = header.width * header.height * sizeof(struct pixel);
+    pixbufsize = pixels * sizeof(struct pixel);
     pixbuf = malloc(pixbufsize);
     
     if (pixbuf == NULL) {
         printf("Memory allocation failed (1)");
-        return 1;
+        fclose(fp);
+        return NULL;
     }
     
     /* get pixel data from BMP image */
-    get_data(fp, pixbuf, &header);
+    get_data(fp, pixbuf, h);
     
     /* we got the data, so now we can close the file */
     fclose(fp); 
     
-    /* create output file in the right format */
-    if (opts.format == FORMAT_CARRAY) {
-        
-        switch (opts.bpp) {
-            case 8:
-                create_c_array_8bit(pixbuf, pixels, &opts, &header);
-                break;
-            case 12:
-                create_c_array_12bit(pixbuf, pixels, &opts, &header);
-                break;
-            case 16:
-                create_c_array_16bit(pixbuf, pixels, &opts, &header);
-                break;
-            case 24:
-                create_c_array_24bit(pixbuf, pixels, &opts, &header);
-                break;
-            default:
-                printf("C array output %d bits per pixel is not supported\n", opts.bpp);
-        }
-        
-    } else if (opts.format == FORMAT_RAW) {
-        
-        switch (opts.bpp) {
-            case 8:
-                create_raw_8bit(pixbuf, pixels, &opts);
-                break;
-            case 12:
-                create_raw_12bit(pixbuf, pixels, &opts);
-                break;
-            case 16:
-                create_raw_16bit(pixbuf, pixels, &opts);
-                break;
-            case 24:
-                create_raw_24bit(pixbuf, pixels, &opts);
-                break;
-            default:
-                printf("RAW output %d bits per pixel is not supported\n", opts.bpp);
-        }
-    }
-       
-    return 0;   
+    if (opts.premultiply) premultiply(pixbuf, pixels);
+    
+    return pixbuf;
 }
 
 /* Get BMP header and save it in a bmp_header structure
  * 
  * Arguments:   fp:     pointer to file descriptor
  *              h:      pointer to bmp_header structure 
+ *              error:  set to the reason if the header is not valid
  * 
  * Return:      1 if succesfully read the header and the BMP is
- *              in a valid format (24bpp, uncompressed)    
+ *              in a valid format (24/32bpp, uncompressed)    
  */
-int get_header(FILE *fp, struct bmp_header *h)
+int get_header(FILE *fp, struct bmp_header *h, char **error)
 {
     /* get and check identifier. offset: 0x00 size: 2 bytes */
     fread(&h->identifier,sizeof(unsigned short), 1, fp);
     
     if (h->identifier != 0x4D42) {
-        printf("Unknown identifier.\n");
+        *error = "Unknown identifier.";
         return 0;
     }
     
@@ -202,7 +970,7 @@ int get_header(FILE *fp, struct bmp_header *h)
     
     /* get bitmap data offset. offset: 0x0A size: 4 bytes */
     if (fseek(fp, 4, SEEK_CUR) != 0) {
-        printf("fseek failed.\n");
+        *error = "fseek failed.";
         return 0;
     }
     
@@ -216,28 +984,34 @@ int get_header(FILE *fp, struct bmp_header *h)
     
     /* get and check image height. offset: 0x16 size: 4 bytes */
     fread(&h->height,sizeof(unsigned int), 1, fp);
+    
+    if (h->height > 0x7FFFFFFF) {
+        *error = "image should be stored bottom up (positive height)";
+        return 0;
+    }
         
     /* get and check planes. offset: 0x1A size: 2 bytes */
     fread(&h->planes,sizeof(unsigned short), 1, fp);
     
     if (h->planes != 1) {
-        printf("planes should be 1\n");
+        *error = "planes should be 1";
         return 0;
     }
     
     /* get and check bpp. offset: 0x1c size: 2 bytes */
     fread(&h->bpp ,sizeof(unsigned short), 1, fp);
     
-    if (h->bpp != 24) {
-        printf("image should be 24 bits per pixel\n");
+    if (h->bpp != 24 && h->bpp != 32) {
+        *error = "image should be 24 or 32 bits per pixel";
         return 0;
     }
     
     /* get and check compression. offset: 0x1E size: 4 bytes */
     fread(&h->compression ,sizeof(unsigned int), 1, fp);
     
-    if (h->compression != 0) {
-        printf("bmp file should be not compressed\n");
+    /* 32 bit images may describe their BGRA layout with bit fields */
+    if (h->compression != BI_RGB && ! (h->bpp == 32 && h->compression == BI_BITFIELDS)) {
+        *error = "bmp file should be not compressed";
         return 0;
     }
     
@@ -256,6 +1030,32 @@ int get_header(FILE *fp, struct bmp_header *h)
     /* get important colors. offset: 0x32 size: 4 bytes */
     fread(&h->important_colors ,sizeof(unsigned int), 1, fp);
     
+    /* without bit fields a 32 bit image is BGRA, the alpha byte may be unused */
+    h->red_mask = 0x00FF0000;
+    h->green_mask = 0x0000FF00;
+    h->blue_mask = 0x000000FF;
+    h->alpha_mask = (h->bpp == 32) ? 0xFF000000 : 0;
+    
+    if (h->compression == BI_BITFIELDS) {
+        /* get color masks. offset: 0x36 size: 3x4 bytes */
+        fread(&h->red_mask ,sizeof(unsigned int), 1, fp);
+        fread(&h->green_mask ,sizeof(unsigned int), 1, fp);
+        fread(&h->blue_mask ,sizeof(unsigned int), 1, fp);
+        
+        /* get alpha mask, only in V3 and later headers. offset: 0x42 size: 4 bytes */
+        if (h->header_size >= 56) {
+            fread(&h->alpha_mask ,sizeof(unsigned int), 1, fp);
+        } else {
+            h->alpha_mask = 0;
+        }
+        
+        if (h->red_mask != 0x00FF0000 || h->green_mask != 0x0000FF00 || h->blue_mask != 0x000000FF
+            || (h->alpha_mask != 0 && h->alpha_mask != 0xFF000000)) {
+            *error = "only BGRA bit fields are supported";
+            return 0;
+        }
+    }
+    
     return 1;    
 }
 
@@ -270,15 +1070,16 @@ int get_header(FILE *fp, struct bmp_header *h)
  * Return:      nothing
  */
 void get_data(FILE *fp, struct pixel *pixbuf, struct bmp_header *h) {
-
+    
     int padding;
     unsigned int line, linebyte;
+    unsigned char alpha = 0;
     struct pixel *pix = pixbuf;
     
     /* calculate padding bytes, every line starts at a 32bit boundary */
-    padding = ((header.width * 3) % 4);
+    padding = (4 - (h->width * (h->bpp / 8)) % 4) % 4;
     
-    fseek(fp, header.data_offset, SEEK_SET);
+    fseek(fp, h->data_offset, SEEK_SET);
     
     /* for each line */
     for (line = 0; line< h->height; line++) {
@@ -288,6 +1089,13 @@ void get_data(FILE *fp, struct pixel *pixbuf, struct bmp_header *h) {
             fread(&pix->b ,sizeof(unsigned char), 1, fp);
             fread(&pix->g ,sizeof(unsigned char), 1, fp);
             fread(&pix->r ,sizeof(unsigned char), 1, fp);
+            
+            if (h->bpp == 32) {
+                fread(&pix->a ,sizeof(unsigned char), 1, fp);
+                alpha |= pix->a;
+            } else {
+                pix->a = 0xFF;
+            }
             //printf("Line: %u r: %u g: %u b: %u\n", line, pix->r, pix->g, pix->b);
         }
         
@@ -296,615 +1104,4787 @@ void get_data(FILE *fp, struct pixel *pixbuf, struct bmp_header *h) {
             fseek(fp, padding, SEEK_CUR);
         }
     }
+    
+    /* many writers leave the fourth byte of a 32 bit image zero,
+     * a fully transparent image is taken as an opaque one.
+     */
+    if (h->alpha_mask == 0 || (h->bpp == 32 && h->compression == BI_RGB && alpha == 0)) {
+        for (pix = pixbuf; pix < pixbuf + h->width * h->height; pix++) {
+            pix->a = 0xFF;
+        }
+    }
                    
 }
 
-/* Save the contents of the pixel buffer to a file
- * as an C array with 8 bits per pixel.
- * Pixel format: RRRGGGBB 
+/* Multiply the color channels with alpha, so the target can blend
+ * with dst * (255 - a) / 255 + src instead of multiplying src too.
+ * c * a / 255 is rounded to nearest without a division.
  * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
- *              o:       pointer to options structure
- *              h:       pointer to bmp_header structure     
+ * Arguments:   pixbuf: pointer to array of pixel structures
+ *              n:      number of pixels
  * 
- * Return:      0 if failed to create output file
+ * Return:      nothing
  */
-int create_c_array_8bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h) {
+void premultiply(struct pixel *pixbuf, int n)
+{
+    unsigned int x;
     
-    FILE *fp;
-    int i, file_exists;
-    unsigned char b;
-    struct pixel *pix = buf;
+    for (; n > 0; n--, pixbuf++) {
+        if (pixbuf->a == 0xFF) continue;
+        
+        x = pixbuf->r * pixbuf->a + 128;
+        pixbuf->r = (x + (x >> 8)) >> 8;
+        x = pixbuf->g * pixbuf->a + 128;
+        pixbuf->g = (x + (x >> 8)) >> 8;
+        x = pixbuf->b * pixbuf->a + 128;
+        pixbuf->b = (x + (x >> 8)) >> 8;
+    }
+}
+
+/* Pack pixels as 12 bits per pixel (rgb444).
+ * Pixel format: RRRRGGGG BBBB[RRRR GGGGBBBB] (two pixels)
+ * The last byte is omitted for the last pixel of an uneven number of pixels.
+ *
+ * Arguments:   pix:     pointer to array of pixel structures
+ *              n:       number of pixels to pack
+ *              dst:     pointer to destination buffer
+ *
+ * Return:      number of bytes written to dst
+ */
+int pack_rgb444(struct pixel *pix, int n, unsigned char *dst)
+{
+    int i;
+    unsigned char *d = dst;
     
-    /* check if file exists */
-    if (fopen(o->output_file, "r") == NULL) {
-        file_exists = 0;
-    } else {
-        file_exists = EXISTS;
+    for (i = 0; (i+2) <= n; i += 2, pix += 2) {
+        *d++ = (pix[0].r & 0xF0) | (pix[0].g >> 4);
+        *d++ = (pix[0].b & 0xF0) | (pix[1].r >> 4);
+        *d++ = (pix[1].g & 0xF0) | (pix[1].b >> 4);
     }
     
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "a+");
-    } else {
-        fp = fopen(o->output_file, "w+");
+    if (i < n) {
+        *d++ = (pix->r & 0xF0) | (pix->g >> 4);
+        *d++ = (pix->b & 0xF0);
     }
     
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
+    return d - dst;
+}
+
+/* Pack pixels as 12 bits per pixel (rgb444) through a lookup table,
+ * see pack_rgb444() and build_lut().
+ *
+ * Arguments:   pix:     pointer to array of pixel structures
+ *              n:       number of pixels to pack
+ *              dst:     pointer to destination buffer
+ *              lut:     lookup table of each channel
+ *
+ * Return:      number of bytes written to dst
+ */
+int packlut_rgb444(struct pixel *pix, int n, unsigned char *dst, unsigned char (*lut)[256])
+{
+    int i;
+    unsigned char *d = dst;
+    
+    for (i = 0; (i+2) <= n; i += 2, pix += 2) {
+        *d++ = (lut[LUT_r][pix[0].r] & 0xF0) | (lut[LUT_g][pix[0].g] >> 4);
+        *d++ = (lut[LUT_b][pix[0].b] & 0xF0) | (lut[LUT_r][pix[1].r] >> 4);
+        *d++ = (lut[LUT_g][pix[1].g] & 0xF0) | (lut[LUT_b][pix[1].b] >> 4);
     }
     
-    if (o->append == APPEND && file_exists) {
-        fprintf(fp, "\n\n");
-    } else {
-        fprintf(fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+    if (i < n) {
+        *d++ = (lut[LUT_r][pix->r] & 0xF0) | (lut[LUT_g][pix->g] >> 4);
+        *d++ = (lut[LUT_b][pix->b] & 0xF0);
     }
     
-    fprintf(fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
-    fprintf(fp, " * Each pixel has 8 bits (RRRGGGBB).\n");
-    fprintf(fp, " */\n");
-    fprintf(fp, "unsigned char %s[] = {\n\t", o->arrayname);
+    return d - dst;
+}
+
+/* Unpack pixels of 12 bits per pixel (rgb444), see pack_rgb444().
+ *
+ * Arguments:   src:     pointer to packed bytes
+ *              n:       number of pixels to unpack
+ *              pix:     pointer to array of pixel structures
+ *
+ * Return:      number of bytes read from src
+ */
+int unpack_rgb444(unsigned char *src, int n, struct pixel *pix)
+{
+    int i;
+    unsigned char *s = src;
+    
+    for (i = 0; (i+2) <= n; i += 2, pix += 2, s += 3) {
+        pix[0].r = (s[0] >> 4) * 17;
+        pix[0].g = (s[0] & 0x0F) * 17;
+        pix[0].b = (s[1] >> 4) * 17;
+        pix[1].r = (s[1] & 0x0F) * 17;
+        pix[1].g = (s[2] >> 4) * 17;
+        pix[1].b = (s[2] & 0x0F) * 17;
+        pix[0].a = pix[1].a = 255;
+    }
     
-    /* write array data */
-    for (i=0; i< pixels; i++) {
-        
-        b = pix->r;
-        b &= ~(0xFF >> 3);
-        b |= (pix->g >> 3);
-        b &= ~(0xFF >> 6);
-        b |= (pix->b >> 6);
-        
-        fprintf(fp, "0x%.2x, ", b);
-          
-        pix++;
-        
-        /* a new line after each 12 pixels (12 bytes).
-         * We have written i+1 pixels.
-         */         
-        if (((i+1) % 12) == 0) {
-            fprintf(fp, "\n\t");
-        }
-             
-        
+    if (i < n) {
+        pix->r = (s[0] >> 4) * 17;
+        pix->g = (s[0] & 0x0F) * 17;
+        pix->b = (s[1] >> 4) * 17;
+        pix->a = 255;
+        s += 2;
     }
-    fprintf(fp, "\n};");
-    fclose(fp);
     
-    return 1;
+    return s - src;
+}
+
+/* Convert BT.601 studio range YUV to an opaque RGB pixel.
+ * The offset keeps the sums positive before the shift.
+ *
+ * Arguments:   y, u, v: the YUV values
+ *              p:       pointer to pixel structure to save it in
+ *
+ * Return:      nothing
+ */
+void yuv_to_rgb(int y, int u, int v, struct pixel *p)
+{
+    int c[3], i;
+    
+    y = 298 * (y - 16) + 128 + (512 << 8);
+    c[0] = ((y + 409 * (v - 128)) >> 8) - 512;
+    c[1] = ((y - 100 * (u - 128) - 208 * (v - 128)) >> 8) - 512;
+    c[2] = ((y + 516 * (u - 128)) >> 8) - 512;
+    
+    for (i = 0; i < 3; i++) {
+        if (c[i] < 0) c[i] = 0;
+        if (c[i] > 255) c[i] = 255;
+    }
+    
+    p->r = (unsigned char)c[0];
+    p->g = (unsigned char)c[1];
+    p->b = (unsigned char)c[2];
+    p->a = 255;
 }
 
-/* Save the contents of the pixel buffer to a file
- * as an C array with 12 bits per pixel.
- * Pixel format: RRRRGGGG BBBB[RRRR GGGGBBBB] (two pixels) 
+/* Build the lookup tables of an output: the -lut file, then -gamma,
+ * then the quantization to the bits of the channel in the pixel
+ * format, truncated or with -round rounded to nearest. The result is
+ * stored MSB aligned, so the packing function keeps only its shift
+ * and each channel costs one table lookup. Alpha is only quantized.
+ * out->lut is NULL if no correction is asked for.
  * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
+ * Arguments:   out:     pointer to output structure
  *              o:       pointer to options structure
- *              h:       pointer to bmp_header structure     
  * 
- * Return:      0 if failed to create output file
+ * Return:      0 if failed
  */
-int create_c_array_12bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h) {
+int build_lut(struct output *out, struct options *o)
+{
+    static const char channels[] = "rgba";
+    struct pixfmt *f = out->pixfmt;
+    unsigned char (*lut)[256];
+    char *c;
+    double v;
+    long len;
+    int ch, i, bits;
     
-    FILE *fp;
-    int i, file_exists;
-    unsigned char b1, b2, b3;
-    struct pixel *pix = buf;
+    out->lut = NULL;
     
-    /* check if file exists */
-    if (fopen(o->output_file, "r") == NULL) {
-        file_exists = 0;
-    } else {
-        file_exists = EXISTS;
-    }
+    if (o->gamma[0] == 0 && o->lut_file == NULL && ! o->round) return 1;
     
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "a+");
-    } else {
-        fp = fopen(o->output_file, "w+");
+    if (o->lut_file != NULL && o->lut_table == NULL) {
+        o->lut_table = read_file(o->lut_file, &len);
+        
+        if (o->lut_table == NULL || len != 3 * 256) {
+            printf("%s should hold 768 bytes: 256 red, green and blue values\n", o->lut_file);
+            free(o->lut_table);
+            o->lut_table = NULL;
+            return 0;
+        }
     }
     
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
-    }
+    lut = malloc(4 * sizeof(*lut));
     
-    if (o->append == APPEND && file_exists) {
-        fprintf(fp, "\n\n");
-    } else {
-        fprintf(fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+    if (lut == NULL) {
+        printf("Memory allocation failed (16)");
+        return 0;
     }
     
-    fprintf(fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
-    fprintf(fp, " * Each pixel has 12 bits, two pixels share three bytes (RRRRGGGG BBBBRRRR GGGGBBBB).\n");
-    fprintf(fp, " */\n");
-    fprintf(fp, "unsigned char %s[] = {\n\t", o->arrayname);
-    
-    /* write array data */
-    for (i=0; i< pixels; i+=2) {
-        
-        b1 = pix->r;
-        b1 &= ~0x0F;
-        b1 |= (pix->g >> 4);
+    for (ch = 0; ch < 4; ch++) {
+        c = strchr(f->order, channels[ch]);
+        bits = (c != NULL) ? f->bits[c - f->order] : 8;
         
-        b2 = pix->b;
-        b2 &= ~0x0F;
-           
-        /* don't write last byte for last pixel of an uneven number of pixels */
-        if ((i+2) <= pixels) {
-            pix++;
-            b2 |= (pix->r >> 4);
+        for (i = 0; i < 256; i++) {
+            v = i;
             
-            b3 = pix->g;
-            b3 &= ~0x0F;
-            b3 |= (pix->b >> 4);
+            if (ch < 3 && o->lut_table != NULL) v = o->lut_table[ch * 256 + i];
+            if (ch < 3 && o->gamma[0] != 0) v = 255.0 * pow(v / 255.0, o->gamma[ch]);
             
-            fprintf(fp, "0x%.2x, 0x%.2x, 0x%.2x, ", b1, b2, b3);
-        } else {
-            fprintf(fp, "0x%.2x, 0x%.2x, ", b1, b2);
+            if (o->round) {
+                v = floor(v * ((1 << bits) - 1) / 255.0 + 0.5);
+                lut[ch][i] = (unsigned char)((int)v << (8 - bits));
+            } else {
+                lut[ch][i] = (unsigned char)((int)floor(v + 0.5) & (0xFF << (8 - bits)));
+            }
         }
+    }
+    
+    out->lut = lut;
+    
+    return 1;
+}
+
+/* Find a pixel format by name or by number of bits per pixel
+ * 
+ * Arguments:   name:    pixel format name (rgb565) or bits per pixel (16)
+ * 
+ * Return:      pointer to pixel format or NULL if it is not supported
+ */
+struct pixfmt *find_pixfmt(char *name)
+{
+    int i;
+    
+    for (i = 0; i < NUM_PIXFMTS; i++) {
+        if (strcmp(pixfmts[i].name, name) == 0) return &pixfmts[i];
+    }
+    
+    /* only a plain number is a bits per pixel value, not 16x */
+    if (*name == '\0' || name[strspn(name, "0123456789")] != '\0') return NULL;
+    
+    for (i = 0; i < NUM_PIXFMTS; i++) {
+        if (pixfmts[i].bpp == atoi(name)) return &pixfmts[i];
+    }
+    
+    return NULL;
+}
+
+/* Write packed bytes to an output file.
+ * C array output gets a new line after each 12 bytes, a partial
+ * packing unit (the 12 bit tail) counts as a whole unit for this.
+ * A sharded C array continues in the next file after shard_bytes.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              data:    pointer to packed bytes
+ *              len:     number of bytes
+ *              partial: nonzero if data is the tail of a partial unit
+ *
+ * Return:      nothing
+ */
+void emit_bytes(struct output *out, unsigned char *data, int len, int partial)
+{
+    static const char hex[] = "0123456789abcdef";
+    char line[BYTES_PER_LINE * 6 + 3];
+    int i, pos = 0;
+    long room;
+    
+    if (out->format == FORMAT_RAW) {
+        fwrite(data, sizeof(unsigned char), len, out->fp);
+        out->bytes += len;
+        return;
+    }
+    
+    /* a sharded C array goes on in the next file at a shard boundary */
+    if (out->shards > 0 && len > 0) {
+        room = (out->shard + 1) * out->shard_bytes - (long)out->bytes;
         
-        pix++;
-        
-        /* a new line after each 8 pixels (12 bytes).
-         * We have written i+2 pixels.
-         */         
-        if (((i+2) % 8) == 0) {
-            fprintf(fp, "\n\t");
+        if (room == 0 && out->shard + 1 < out->shards) {
+            fprintf(out->fp, "\n};");
+            out->fp = out->shard_fp[++out->shard];
+            room = out->shard_bytes;
         }
-             
         
+        if (len > room && room > 0) {
+            emit_bytes(out, data, room, 0);
+            emit_bytes(out, data + room, len - room, partial);
+            return;
+        }
     }
-    fprintf(fp, "\n};");
-    fclose(fp);
     
-    return 1;
+    for (i = 0; i < len; i++) {
+        line[pos++] = '0';
+        line[pos++] = 'x';
+        line[pos++] = hex[data[i] >> 4];
+        line[pos++] = hex[data[i] & 0x0F];
+        line[pos++] = ',';
+        line[pos++] = ' ';
+        out->bytes++;
+    
+        if (! partial && ((out->bytes - out->array_start) % BYTES_PER_LINE) == 0
+            && out->bytes != out->array_end) {
+            line[pos++] = '\n';
+            line[pos++] = '\t';
+        }
+    
+        /* flush when a whole line might not fit anymore */
+        if (pos > BYTES_PER_LINE * 6 - 6 || i == len-1) {
+            fwrite(line, sizeof(char), pos, out->fp);
+            pos = 0;
+        }
+    }
+    
+    if (partial) {
+        int missing = out->pixfmt->unit_bytes - len;
+    
+        if (((out->bytes + missing - out->array_start) % BYTES_PER_LINE) == 0
+            && out->bytes + missing != out->array_end) {
+            fprintf(out->fp, "\n\t");
+        }
+    }
 }
 
-/* Save the contents of the pixel buffer to a file
- * as an C array with 16 bits per pixel.
- * Pixel format: RRRRRGGG GGGBBBBB 
- * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
+/* Open an output file and write the C array preamble.
+ *
+ * Arguments:   out:     pointer to output structure
  *              o:       pointer to options structure
- *              h:       pointer to bmp_header structure     
- * 
+ *              h:       pointer to bmp_header structure
+ *              pixels:  number of pixels in the image
+ *
  * Return:      0 if failed to create output file
  */
-int create_c_array_16bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h) {
-    
+int open_output(struct output *out, struct options *o, struct bmp_header *h, int pixels)
+{
     FILE *fp;
-    int i, file_exists;
-    unsigned char b1, b2;
-    struct pixel *pix = buf;
+    int file_exists = 0;
+    char name[64], *path;
+    long total = 0;
+    
+    out->bytes = 0;
+    out->pending_pixels = 0;
+    out->stride = 0;
+    out->bank_rows = 0;
+    out->banks = 0;
+    out->array_start = 0;
+    out->array_end = 0;
+    out->shards = 0;
+    
+    if (o->layout != UNSET && out->pixfmt->pack == NULL) {
+        printf("%s can not be written in tiles\n", out->pixfmt->name);
+        return 0;
+    }
+    
+    if (o->layout != UNSET && row_aligned(out->pixfmt) && o->tile_width % out->pixfmt->unit_pixels != 0) {
+        printf("tiles of %s need a width that is a multiple of %d pixels\n",
+               out->pixfmt->name, out->pixfmt->unit_pixels);
+        return 0;
+    }
+    
+    /* rows of an image padded to the stride, and split in banks */
+    if ((o->stride > 0 || o->bank_size > 0) && o->sequence == NULL && o->font == NULL
+        && out->pixfmt->pack != NULL) {
+        out->row_bytes = packed_size(out->pixfmt, h->width);
+        out->stride = out->row_bytes;
+        
+        if (o->stride > 0) {
+            out->stride = (out->stride + o->stride - 1) / o->stride * o->stride;
+        }
+        
+        if (o->bank_size > 0) {
+            out->bank_rows = o->bank_size / out->stride;
+            
+            if (out->bank_rows == 0) {
+                printf("a row of %d bytes does not fit in a bank of %ld bytes\n", out->stride, o->bank_size);
+                return 0;
+            }
+            
+            out->array_end = (unsigned long)out->stride * out->bank_rows;
+            if (h->height < (unsigned int)out->bank_rows) out->array_end = (unsigned long)out->stride * h->height;
+        }
+    }
+    
+    /* a C array split over files, the output file becomes a header */
+    if (o->shards > 0 && out->format == FORMAT_CARRAY && o->sequence == NULL && o->font == NULL) {
+        total = plan_shards(out, o, h);
+        if (total == 0) return 0;
+    }
+    
+    path = (out->shards > 0) ? out->header_file : out->file;
     
     /* check if file exists */
-    if (fopen(o->output_file, "r") == NULL) {
-        file_exists = 0;
-    } else {
+    fp = fopen(path, "r");
+    
+    if (fp != NULL) {
         file_exists = EXISTS;
+        fclose(fp);
     }
     
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "a+");
+    /* check if we append or overwrite if file exists,
+     * a new file replaces the old one when it is complete
+     */
+    if (out->format == FORMAT_CARRAY) {
+        out->fp = open_replace(path, (o->append == APPEND) ? "a+" : "w+", &out->tmp_file);
     } else {
-        fp = fopen(o->output_file, "w+");
+        out->fp = open_replace(path, (o->append == APPEND) ? "ab+" : "wb+", &out->tmp_file);
     }
     
     /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
+    if (out->fp == NULL) {
+        printf("Failed open output file %s\n", path);
+        free(out->header_file);
         return 0;
     }
     
-    if (o->append == APPEND && file_exists) {
-        fprintf(fp, "\n\n");
-    } else {
-        fprintf(fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+    /* room for one packed image line and a completed unit */
+    out->buf = malloc(h->width * 4 + 4);
+    
+    if (out->buf == NULL) {
+        printf("Memory allocation failed (6)");
+        close_replace(out->fp, path, out->tmp_file, 0);
+        free(out->header_file);
+        return 0;
+    }
+    
+    /* gamma and color correction, 1 bit pages apply it before the threshold */
+    out->lut = NULL;
+    
+    if (! build_lut(out, o)) {
+        free(out->buf);
+        close_replace(out->fp, path, out->tmp_file, 0);
+        free(out->header_file);
+        return 0;
     }
     
-    fprintf(fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
-    fprintf(fp, " * Each pixel has 16 bits (RRRRRGGG GGGBBBBB).\n");
-    fprintf(fp, " */\n");
-    fprintf(fp, "unsigned char %s[] = {\n\t", o->arrayname);
+    out->dither = o->dither && out->pixfmt->packing == PACKING_GRAY && o->sequence == NULL && o->font == NULL;
+    
+    if (out->format == FORMAT_CARRAY) {
+        if (o->append == APPEND && file_exists) {
+            fprintf(out->fp, "\n\n");
+        } else {
+            fprintf(out->fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+        }
+        
+        if (out->shards > 0) {
+            macro_name(name, out->arrayname, sizeof(name));
+            fprintf(out->fp, "#ifndef %s_H\n#define %s_H\n\n", name, name);
+        }
+    }
     
-    /* write array data */
-    for (i=0; i< pixels; i++) {
+    /* a sequence or a font writes its own arrays */
+    if (out->format == FORMAT_CARRAY && o->sequence == NULL && o->font == NULL) {
+        fprintf(out->fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
+        fprintf(out->fp, " * Each pixel has %s.\n", out->pixfmt->layout);
+        
+        if (out->pixfmt->packing == PACKING_PAGED) {
+            fprintf(out->fp, " * Pages go from the top to the bottom of the image, the rows of the other\n");
+            fprintf(out->fp, " * pixel formats keep the bottom up order of the BMP.\n");
+        }
+        
+        if (out->stride > 0) {
+            fprintf(out->fp, " * Each row starts at a byte and takes %d bytes (stride).\n", out->stride);
+        } else if (out->pixfmt->packing == PACKING_GRAY && o->layout == UNSET) {
+            fprintf(out->fp, " * Each row starts at a byte.\n");
+        } else if (row_aligned(out->pixfmt) && o->layout == UNSET) {
+            fprintf(out->fp, " * Each row starts with a new macropixel, a last single pixel is repeated.\n");
+        }
+        
+        if (out->bank_rows > 0) {
+            fprintf(out->fp, " * The rows are split in banks of %d rows: %s_0[], %s_1[], ...\n",
+                    out->bank_rows, out->arrayname, out->arrayname);
+        }
+        
+        if (o->layout != UNSET) {
+            fprintf(out->fp, " * The image is stored in %ux%u tiles of %ux%u pixels, left to right and\n",
+                    (h->width + o->tile_width - 1) / o->tile_width,
+                    (h->height + o->tile_height - 1) / o->tile_height, o->tile_width, o->tile_height);
+            fprintf(out->fp, " * then down, each starting at a byte, %s.\n",
+                    (o->layout == LAYOUT_MORTON) ? "pixels in Morton (Z) order" : "pixels row by row");
+            fprintf(out->fp, " * Pixels of edge tiles outside the image are zero.\n");
+        }
         
-        b1 = pix->r;        
-        b1 &= ~(0xFF >> 5); 
-        b1 |= (pix->g >> 5);
+        if (out->shards > 0) {
+            fprintf(out->fp, " * The %ld bytes are split over %d arrays of %ld bytes (the last one may\n",
+                    total, out->shards, out->shard_bytes);
+            fprintf(out->fp, " * be smaller), %s_0[] to %s_%d[], each in its own file. Byte i of the\n",
+                    out->arrayname, out->arrayname, out->shards - 1);
+            macro_name(name, out->arrayname, sizeof(name));
+            fprintf(out->fp, " * image is %s_BYTE(i).\n", name);
+        }
         
-        b2 |= (pix->g << 3);
-        b2 &= ~(0xFF >> 3);
-        b2 |= (pix->b >> 3);
+        fprintf(out->fp, " */\n");
         
-        fprintf(fp, "0x%.2x, 0x%.2x, ", b1, b2);
-          
-        pix++;
+        if (o->layout != UNSET) {
+            macro_name(name, out->arrayname, sizeof(name));
+            fprintf(out->fp, "#define %s_TILE_WIDTH %u\n", name, o->tile_width);
+            fprintf(out->fp, "#define %s_TILE_HEIGHT %u\n", name, o->tile_height);
+            fprintf(out->fp, "#define %s_TILE_BYTES %lu\n\n", name,
+                    packed_size(out->pixfmt, o->tile_width * o->tile_height));
+        }
         
-        /* a new line after each 6 pixels (12 bytes).
-         * We have written i+1 pixels.
-         */         
-        if (((i+1) % 6) == 0) {
-            fprintf(fp, "\n\t");
+        if (out->stride > 0) {
+            macro_name(name, out->arrayname, sizeof(name));
+            fprintf(out->fp, "#define %s_STRIDE %d\n", name, out->stride);
+            if (out->bank_rows > 0) fprintf(out->fp, "#define %s_BANK_ROWS %d\n", name, out->bank_rows);
+            fprintf(out->fp, "\n");
         }
-             
         
+        if (out->shards > 0) {
+            if (! open_shards(out, o, total)) {
+                free(out->buf);
+                free(out->lut);
+                close_replace(out->fp, path, out->tmp_file, 0);
+                free(out->header_file);
+                return 0;
+            }
+        } else if (out->bank_rows > 0) {
+            sprintf(name, "%.50s_0", out->arrayname);
+            begin_array(out, o, name, 0);
+        } else {
+            begin_array(out, o, out->arrayname, 0);
+        }
     }
-    fprintf(fp, "\n};");
-    fclose(fp);
+    
+    if (out->bank_rows > 0) out->banks = 1;
     
     return 1;
 }
 
-/* Save the contents of the pixel buffer to a file
- * as an C array with 24 bits per pixel.
- * Pixel format: RRRRRRRR GGGGGGGG BBBBBBBB 
- * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
+/* Start a C array of bytes, with the -const, -arrayalign and -section
+ * attributes. A %d in the section name is replaced by the bank number.
+ *
+ * Arguments:   out:     pointer to output structure
  *              o:       pointer to options structure
- *              h:       pointer to bmp_header structure     
- * 
- * Return:      0 if failed to create output file
+ *              name:    name of the array
+ *              bank:    bank number
+ *
+ * Return:      nothing
  */
-int create_c_array_24bit(struct pixel *buf, int pixels, struct options *o, struct bmp_header *h) {
+void begin_array(struct output *out, struct options *o, char *name, int bank)
+{
+    fprintf(out->fp, "%sunsigned char %s[]", o->constant ? "const " : "", name);
     
-    FILE *fp;
-    int i, file_exists;
-    struct pixel *pix = buf;
+    if (o->array_align > 0) {
+        fprintf(out->fp, " __attribute__((aligned(%d)))", o->array_align);
+    }
     
-    /* check if file exists */
-    if (fopen(o->output_file, "r") == NULL) {
-        file_exists = 0;
-    } else {
-        file_exists = EXISTS;
+    if (o->section != NULL) {
+        fprintf(out->fp, " __attribute__((section(\"");
+        fprintf(out->fp, o->section, bank);
+        fprintf(out->fp, "\")))");
     }
     
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "a+");
+    fprintf(out->fp, " = {\n\t");
+}
+
+/* Split the C array of an output over files (-shards): the size of
+ * every shard, whole lines of the array, and the name of the header
+ * that replaces the output file, <file without extension>.h.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              o:       pointer to options structure
+ *              h:       pointer to bmp_header structure
+ *
+ * Return:      number of bytes of the image, 0 if failed
+ */
+long plan_shards(struct output *out, struct options *o, struct bmp_header *h)
+{
+    char *dot = strrchr(out->file, '.');
+    long total;
+    int len;
+    
+    if (o->layout != UNSET) {
+        total = (long)((h->width + o->tile_width - 1) / o->tile_width)
+                * ((h->height + o->tile_height - 1) / o->tile_height)
+                * packed_size(out->pixfmt, o->tile_width * o->tile_height);
+    } else if (out->stride > 0) {
+        total = (long)out->stride * h->height;
     } else {
-        fp = fopen(o->output_file, "w+");
+        total = image_size(out->pixfmt, h->width, h->height);
     }
     
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
+    out->shard_bytes = (total + o->shards - 1) / o->shards;
+    out->shard_bytes = (out->shard_bytes + BYTES_PER_LINE - 1) / BYTES_PER_LINE * BYTES_PER_LINE;
+    out->shards = (total + out->shard_bytes - 1) / out->shard_bytes;
+    
+    len = (dot != NULL && strpbrk(dot, "/\\") == NULL) ? dot - out->file : (int)strlen(out->file);
+    out->header_file = malloc(len + 3);
+    
+    if (out->header_file == NULL) {
+        printf("Memory allocation failed (26)");
+        out->shards = 0;
         return 0;
     }
     
-    if (o->append == APPEND && file_exists) {
-        fprintf(fp, "\n\n");
-    } else {
-        fprintf(fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+    sprintf(out->header_file, "%.*s.h", len, out->file);
+    
+    return total;
+}
+
+/* Write the shard declarations to the header of a sharded C array and
+ * open the files of all shards: <file without extension>_<n>.c, each
+ * includes the header and starts its array, the first also has the
+ * table of the shards. The shards replace their old versions only
+ * when all are complete, see close_shards().
+ *
+ * Arguments:   out:     pointer to output structure, fp is the header
+ *              o:       pointer to options structure
+ *              total:   number of bytes of the image
+ *
+ * Return:      0 if failed, the files that were opened are removed
+ */
+int open_shards(struct output *out, struct options *o, long total)
+{
+    char name[64], *base, *c = o->constant ? "const " : "", *pc = o->constant ? " const " : "";
+    int i, k, len = strlen(out->header_file) - 2;
+    
+    macro_name(name, out->arrayname, sizeof(name));
+    fprintf(out->fp, "#define %s_SIZE %ld\n", name, total);
+    fprintf(out->fp, "#define %s_SHARDS %d\n", name, out->shards);
+    fprintf(out->fp, "#define %s_SHARD_BYTES %ld\n", name, out->shard_bytes);
+    fprintf(out->fp, "#define %s_BYTE(i) (%s_shards[(i) / %s_SHARD_BYTES][(i) %% %s_SHARD_BYTES])\n\n",
+            name, out->arrayname, name, name);
+    
+    for (i = 0; i < out->shards; i++) {
+        fprintf(out->fp, "extern %sunsigned char %s_%d[];\n", c, out->arrayname, i);
     }
     
-    fprintf(fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
-    fprintf(fp, " * Each pixel has 24 bits (RRRRRRRR GGGGGGGG BBBBBBBB).\n");
-    fprintf(fp, " */\n");
-    fprintf(fp, "unsigned char %s[] = {\n\t", o->arrayname);
+    fprintf(out->fp, "extern %sunsigned char *%s%s_shards[%d];\n\n", c, pc, out->arrayname, out->shards);
+    fprintf(out->fp, "#endif /* %s_H */\n", name);
     
-    /* write array data */
-    for (i=0; i< pixels; i++) {
-                
-        fprintf(fp, "0x%.2x, 0x%.2x, 0x%.2x, ", pix->r, pix->g, pix->b);
-          
-        pix++;
+    out->header_fp = out->fp;
+    
+    /* the header is included by its name, next to the shards */
+    for (base = out->header_file + strlen(out->header_file); base > out->header_file; base--) {
+        if (base[-1] == '/' || base[-1] == '\\') break;
+    }
+    
+    for (i = 0; i < out->shards; i++) {
+        out->shard_file[i] = malloc(len + 16);
+        out->shard_fp[i] = NULL;
+        
+        if (out->shard_file[i] != NULL) {
+            sprintf(out->shard_file[i], "%.*s_%d.c", len, out->header_file, i);
+            out->shard_fp[i] = open_replace(out->shard_file[i], "w+", &out->shard_tmp[i]);
+        }
+        
+        if (out->shard_fp[i] == NULL) {
+            printf("Failed open output file %s\n", (out->shard_file[i] != NULL) ? out->shard_file[i] : "");
+            free(out->shard_file[i]);
+            out->shards = i;
+            close_shards(out, 0);
+            return 0;
+        }
         
-        /* a new line after each 4 pixels (12 bytes).
-         * We have written i+1 pixels.
-         */         
-        if (((i+1) % 4) == 0) {
-            fprintf(fp, "\n\t");
+        out->fp = out->shard_fp[i];
+        fprintf(out->fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+        fprintf(out->fp, "#include \"%s\"\n\n", base);
+        
+        if (i == 0) {
+            fprintf(out->fp, "%sunsigned char *%s%s_shards[%d] = {", c, pc, out->arrayname, out->shards);
+            
+            for (k = 0; k < out->shards; k++) {
+                fprintf(out->fp, "%s%s_%d,", (k % 4) ? " " : "\n\t", out->arrayname, k);
+            }
+            
+            fprintf(out->fp, "\n};\n\n");
         }
-             
         
+        sprintf(name, "%.50s_%d", out->arrayname, i);
+        begin_array(out, o, name, i);
     }
-    fprintf(fp, "\n};");
-    fclose(fp);
+    
+    out->fp = out->shard_fp[0];
+    out->shard = 0;
     
     return 1;
 }
 
-/* Save the contents of the pixel buffer to a file
- * as RAW with 8 bits per pixel.
- * Pixel format: RRRGGGBB 
- * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
- *              o:       pointer to options structure   
- * 
- * Return:      0 if failed to create output file
+/* Close the files of a sharded C array, they replace their old
+ * versions if all of them are complete, and go back to the header.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              ok:      0 if the output is not complete, it is removed
+ *
+ * Return:      0 if the output is not complete or could not be written
  */
-int create_raw_8bit(struct pixel *buf, int pixels, struct options *o) {
+int close_shards(struct output *out, int ok)
+{
+    int i;
     
-    FILE *fp;
+    for (i = 0; i < out->shards; i++) {
+        if (fflush(out->shard_fp[i]) != 0) ok = 0;
+    }
+    
+    for (i = 0; i < out->shards; i++) {
+        if (! close_replace(out->shard_fp[i], out->shard_file[i], out->shard_tmp[i], ok)) ok = 0;
+        free(out->shard_file[i]);
+    }
+    
+    out->fp = out->header_fp;
+    
+    return ok;
+}
+
+/* Make a macro name prefix from an array name: upper case.
+ *
+ * Arguments:   dst:     buffer for the macro name
+ *              name:    array name
+ *              size:    size of dst
+ *
+ * Return:      nothing
+ */
+void macro_name(char *dst, char *name, int size)
+{
     int i;
-    unsigned char b;
-    struct pixel *pix = buf;
+    
+    for (i = 0; name[i] != '\0' && i < size - 1; i++) {
+        dst[i] = toupper((unsigned char)name[i]);
+    }
+    
+    dst[i] = '\0';
+}
+
+/* Finish a row of an output with padded rows: the row starts at a
+ * byte, is padded with zeros to the stride and a new bank is started
+ * when the bank is full. A raw output pads the bank to the bank size,
+ * so no row crosses a bank boundary.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              o:       pointer to options structure
+ *              line:    the row that was written
+ *              height:  number of rows
+ *
+ * Return:      nothing
+ */
+void end_row(struct output *out, struct options *o, unsigned int line, unsigned int height)
+{
+    static const unsigned char zero[1] = { 0 };
+    char name[64];
+    unsigned int rows;
+    long pad;
+    
+    flush_output(out);
+    
+    for (pad = out->stride - out->row_bytes; pad > 0; pad--) {
+        emit_bytes(out, (unsigned char *)zero, 1, 0);
+    }
+    
+    if (out->bank_rows == 0 || (line + 1) % out->bank_rows != 0 || line + 1 == height) return;
+    
+    if (out->format == FORMAT_CARRAY) {
+        fprintf(out->fp, "\n};\n\n");
+        sprintf(name, "%.50s_%d", out->arrayname, out->banks);
+        begin_array(out, o, name, out->banks);
+        
+        rows = height - line - 1;
+        if (rows > (unsigned int)out->bank_rows) rows = out->bank_rows;
         
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "ab+");
+        out->array_start = out->bytes;
+        out->array_end = out->bytes + (unsigned long)out->stride * rows;
     } else {
-        printf("using fubar\n");
-        fp = fopen(o->output_file, "wb+");
+        for (pad = o->bank_size - (long)out->bank_rows * out->stride; pad > 0; pad--) {
+            emit_bytes(out, (unsigned char *)zero, 1, 0);
+        }
     }
     
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
+    out->banks++;
+}
+
+/* Pack a run of pixels and write them to an output file.
+ * Pixels that do not fill a whole packing unit are kept
+ * until the next call or until the output is closed.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              pix:     pointer to array of pixel structures
+ *              n:       number of pixels
+ *
+ * Return:      nothing
+ */
+void write_output(struct output *out, struct pixel *pix, int n)
+{
+    struct pixfmt *p = out->pixfmt;
+    int whole, len;
+    
+    /* complete a unit started by the previous run */
+    while (out->pending_pixels > 0 && n > 0) {
+        out->pending[out->pending_pixels++] = *pix++;
+        n--;
+    
+        if (out->pending_pixels == p->unit_pixels) {
+            len = pack_output(out, out->pending, p->unit_pixels, out->buf);
+            emit_bytes(out, out->buf, len, 0);
+            out->pending_pixels = 0;
+        }
+    }
+    
+    whole = n - (n % p->unit_pixels);
+    
+    if (whole > 0) {
+        len = pack_output(out, pix, whole, out->buf);
+        emit_bytes(out, out->buf, len, 0);
+    }
+    
+    for (; whole < n; whole++) {
+        out->pending[out->pending_pixels++] = pix[whole];
     }
+}
 
-    /* write array data */
-    for (i=0; i< pixels; i++) {
+/* Write the remaining pixels and close an output file.
+ * Banked C arrays get a table of their banks.
+ *
+ * Arguments:   out:     pointer to output structure
+ *              o:       pointer to options structure
+ *              ok:      0 if the output is not complete, it is removed
+ *
+ * Return:      0 if the output is not complete or could not be written
+ */
+int close_output(struct output *out, struct options *o, int ok)
+{
+    int bank;
+    
+    flush_output(out);
+    
+    if (out->format == FORMAT_CARRAY) {
+        fprintf(out->fp, "\n};");
+    }
+    
+    if (out->format == FORMAT_CARRAY && out->bank_rows > 0) {
+        fprintf(out->fp, "\n\n/* row y is at %s_banks[y / %d] + (y %% %d) * %d */\n",
+                out->arrayname, out->bank_rows, out->bank_rows, out->stride);
+        fprintf(out->fp, "%sunsigned char *%s%s_banks[%d] = {", o->constant ? "const " : "",
+                o->constant ? " const " : "", out->arrayname, out->banks);
         
-        b = pix->r;
-        b &= ~(0xFF >> 3);
-        b |= (pix->g >> 3);
-        b &= ~(0xFF >> 6);
-        b |= (pix->b >> 6);
+        for (bank = 0; bank < out->banks; bank++) {
+            fprintf(out->fp, "%s%s_%d,", (bank % 4) ? " " : "\n\t", out->arrayname, bank);
+        }
         
-        fwrite(&b, sizeof(unsigned char), 1, fp);
-          
-        pix++;     
+        fprintf(out->fp, "\n};");
     }
     
-    fclose(fp);
+    free(out->buf);
+    free(out->lut);
     
-    return 1;
+    if (out->shards > 0) {
+        ok = close_shards(out, ok);
+        ok = close_replace(out->fp, out->header_file, out->tmp_file, ok);
+        free(out->header_file);
+        return ok;
+    }
+    
+    return close_replace(out->fp, out->file, out->tmp_file, ok);
+}
+
+/* Pack pixels in the pixel format of an output,
+ * through its lookup table if it has one (and it is not dithered).
+ *
+ * Arguments:   out:     pointer to output structure
+ *              pix:     pointer to array of pixel structures
+ *              n:       number of pixels to pack
+ *              dst:     pointer to destination buffer
+ *
+ * Return:      number of bytes written to dst
+ */
+int pack_output(struct output *out, struct pixel *pix, int n, unsigned char *dst)
+{
+    if (out->lut != NULL && ! out->dither) return out->pixfmt->pack_lut(pix, n, dst, out->lut);
+    
+    return out->pixfmt->pack(pix, n, dst);
 }
 
-/* Save the contents of the pixel buffer to a file
- * as RAW with 12 bits per pixel.
- * Pixel format: RRRRGGGG BBBB[RRRR GGGGBBBB] (two pixels) 
+/* Transpose an 8x8 bit matrix.
+ * Byte i of x is line i, with the leftmost pixel in bit 7.
+ * Byte i of the result is column i (from the left), with line 0 in bit 0.
  * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
- *              o:       pointer to options structure    
+ * Arguments:   x:       8 lines of 8 pixels
  * 
- * Return:      0 if failed to create output file
+ * Return:      8 columns of 8 pixels
  */
-int create_raw_12bit(struct pixel *buf, int pixels, struct options *o) {
-    
-    FILE *fp;
-    int i;
-    unsigned char b1, b2, b3;
-    struct pixel *pix = buf;
+unsigned long long transpose8(unsigned long long x)
+{
+    unsigned long long t;
     
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "ab+");
-    } else {
-        fp = fopen(o->output_file, "wb+");
-    }
+    /* swap 1x1, 2x2 and 4x4 blocks across the diagonal */
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
     
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
-    }
-        
-    /* write array data */
-    for (i=0; i< pixels; i+=2) {
-        
-        b1 = pix->r;
-        b1 &= ~0x0F;
-        b1 |= (pix->g >> 4);
-        
-        b2 = pix->b;
-        b2 &= ~0x0F;
-           
-        /* don't write last byte for last pixel of an uneven number of pixels */
-        if ((i+2) <= pixels) {
+    return x;
+}
+
+/* 8x8 Bayer matrix for ordered dithering, values 0..63 */
+static const unsigned char bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/* Dither a pixel for a gray output: the channels through the lookup
+ * table of the output, plus the Bayer matrix value scaled to less than
+ * one gray step, so the truncation to the output bits dithers. The
+ * luminance weights add up to 256, adding to every channel adds the
+ * same to the luminance.
+ * 
+ * Arguments:   out:     pointer to output structure
+ *              src:     pointer to the pixel
+ *              dst:     pointer to save the dithered pixel in
+ *              x:       column of the pixel
+ *              y:       line of the pixel, from the top
+ * 
+ * Return:      nothing
+ */
+void dither_gray(struct output *out, struct pixel *src, struct pixel *dst, unsigned int x, unsigned int y)
+{
+    int step = 8 - out->pixfmt->bits[0];
+    int t = ((2 * bayer[y & 7][x & 7] + 1) << step) >> 7;
+    int r = src->r, g = src->g, b = src->b;
+    
+    if (out->lut != NULL) {
+        r = out->lut[LUT_r][r];
+        g = out->lut[LUT_g][g];
+        b = out->lut[LUT_b][b];
+    }
+    
+    dst->r = (unsigned char)((r + t > 255) ? 255 : r + t);
+    dst->g = (unsigned char)((g + t > 255) ? 255 : g + t);
+    dst->b = (unsigned char)((b + t > 255) ? 255 : b + t);
+    dst->a = src->a;
+}
+
+/* Write the image as 1 bit per pixel in pages of 8 lines, with one byte
+ * per column of a page and the top line of the page in bit 0
+ * (SSD1306/SH1106 page addressing). Pages and lines go from the top
+ * to the bottom of the image, columns from left to right.
+ * 
+ * A pixel is on when its luminance, after -gamma and -lut, is at least
+ * the threshold, or with dithering when it is above the value of an 8x8
+ * Bayer matrix.
+ * The lines of a page are first packed 8 pixels per byte, then every
+ * 8x8 block is turned into 8 column bytes with one transpose.
+ * 
+ * Arguments:   out:     pointer to output structure
+ *              buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              o:       pointer to options structure
+ * 
+ * Return:      0 if memory allocation failed
+ */
+int write_pages(struct output *out, struct pixel *buf, struct bmp_header *h, struct options *o)
+{
+    unsigned char *bits, *cols;
+    unsigned long long x;
+    unsigned int page, line, y, col, xb, row_bytes, lum, r, g, b, threshold = o->threshold;
+    struct pixel *pix;
+    int i;
+    
+    row_bytes = (h->width + 7) / 8;
+    bits = malloc(8 * row_bytes);
+    cols = malloc(row_bytes * 8);
+    
+    if (bits == NULL || cols == NULL) {
+        printf("Memory allocation failed (12)");
+        free(bits);
+        free(cols);
+        return 0;
+    }
+    
+    for (page = 0; page * 8 < h->height; page++) {
+        memset(bits, 0, 8 * row_bytes);
+        
+        for (line = 0; line < 8; line++) {
+            y = page * 8 + line;
+            if (y >= h->height) break;
+            
+            /* BMP lines are stored bottom up */
+            pix = buf + (h->height - 1 - y) * h->width;
+            
+            for (col = 0; col < h->width; col++, pix++) {
+                r = pix->r;
+                g = pix->g;
+                b = pix->b;
+                
+                if (out->lut != NULL) {
+                    r = out->lut[LUT_r][r];
+                    g = out->lut[LUT_g][g];
+                    b = out->lut[LUT_b][b];
+                }
+                
+                lum = (77 * r + 150 * g + 29 * b) >> 8;
+                
+                if (o->dither ? lum > bayer[y & 7][col & 7] * 4 + 2u : lum >= threshold) {
+                    bits[line * row_bytes + col / 8] |= 0x80 >> (col & 7);
+                }
+            }
+        }
+        
+        for (xb = 0; xb < row_bytes; xb++) {
+            x = 0;
+            
+            for (i = 7; i >= 0; i--) {
+                x = (x << 8) | bits[i * row_bytes + xb];
+            }
+            
+            x = transpose8(x);
+            
+            for (i = 0; i < 8; i++) {
+                cols[xb * 8 + i] = (unsigned char)(x >> (8 * (7 - i)));
+            }
+        }
+        
+        emit_bytes(out, cols, h->width, 0);
+    }
+    
+    free(bits);
+    free(cols);
+    
+    return 1;
+}
+
+/* Write the image as YUV 4:2:0: the Y plane, then the U and V planes
+ * (I420) or one plane of UV pairs (NV12), rows in the same order as the
+ * other formats. Two lines are converted at a time: their Y is written
+ * right away and the U and V of every 2x2 block, from the sum of its
+ * pixels, are kept for the chroma planes. An odd last row or column
+ * is repeated in its block.
+ * 
+ * Arguments:   out:     pointer to output structure
+ *              buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ * 
+ * Return:      0 if memory allocation failed
+ */
+int write_planes(struct output *out, struct pixel *buf, struct bmp_header *h)
+{
+    static unsigned char same[4][256];
+    unsigned char (*lut)[256] = (out->lut != NULL) ? out->lut : same;
+    unsigned int w = h->width, cw = (h->width + 1) / 2, ch = (h->height + 1) / 2;
+    unsigned int x, y, x1;
+    unsigned char *u, *v, *c;
+    struct pixel *p0, *p1;
+    int i, sr, sg, sb;
+    
+    u = malloc(2 * cw * ch);
+    
+    if (u == NULL) {
+        printf("Memory allocation failed (18)");
+        return 0;
+    }
+    
+    v = u + cw * ch;
+    
+    for (i = 0; i < 256; i++) {
+        same[LUT_r][i] = same[LUT_g][i] = same[LUT_b][i] = same[LUT_a][i] = (unsigned char)i;
+    }
+    
+    for (y = 0; y < h->height; y += 2) {
+        p0 = buf + y * w;
+        p1 = (y + 1 < h->height) ? p0 + w : p0;
+        
+        for (x = 0; x < w; x++) {
+            out->buf[x] = YUV_Y(GET_LUT(p0 + x, r), GET_LUT(p0 + x, g), GET_LUT(p0 + x, b));
+        }
+        
+        emit_bytes(out, out->buf, w, 0);
+        
+        if (p1 != p0) {
+            for (x = 0; x < w; x++) {
+                out->buf[x] = YUV_Y(GET_LUT(p1 + x, r), GET_LUT(p1 + x, g), GET_LUT(p1 + x, b));
+            }
+            
+            emit_bytes(out, out->buf, w, 0);
+        }
+        
+        for (x = 0; x < w; x += 2) {
+            x1 = (x + 1 < w) ? x + 1 : x;
+            sr = GET_LUT(p0 + x, r) + GET_LUT(p0 + x1, r) + GET_LUT(p1 + x, r) + GET_LUT(p1 + x1, r);
+            sg = GET_LUT(p0 + x, g) + GET_LUT(p0 + x1, g) + GET_LUT(p1 + x, g) + GET_LUT(p1 + x1, g);
+            sb = GET_LUT(p0 + x, b) + GET_LUT(p0 + x1, b) + GET_LUT(p1 + x, b) + GET_LUT(p1 + x1, b);
+            u[y / 2 * cw + x / 2] = YUV_U(sr, sg, sb, 2);
+            v[y / 2 * cw + x / 2] = YUV_V(sr, sg, sb, 2);
+        }
+    }
+    
+    if (out->pixfmt->packing == PACKING_PLANAR) {
+        emit_bytes(out, u, 2 * cw * ch, 0);
+    } else {
+        /* a row of UV pairs at a time, it fits in the line buffer */
+        for (y = 0; y < ch; y++) {
+            for (x = 0, c = out->buf; x < cw; x++) {
+                *c++ = u[y * cw + x];
+                *c++ = v[y * cw + x];
+            }
+            
+            emit_bytes(out, out->buf, 2 * cw, 0);
+        }
+    }
+    
+    free(u);
+    
+    return 1;
+}
+
+/* Write the pixel buffer to all requested outputs.
+ * The image is walked once, line by line, and each line is
+ * packed for every output while it is still in the cache.
+ *
+ * Arguments:   buf:     pointer to array of pixel structures
+ *              o:       pointer to options structure
+ *              h:       pointer to bmp_header structure
+ *
+ * Return:      0 if one of the output files could not be created
+ */
+int create_outputs(struct pixel *buf, struct options *o, struct bmp_header *h)
+{
+    int i, opened, ok = 1;
+    unsigned int line, x;
+    int pixels = h->width * h->height;
+    struct pixel *row = NULL;
+    
+    for (opened = 0; opened < o->num_outputs; opened++) {
+        if (! open_output(&o->outputs[opened], o, h, pixels)) break;
+    }
+    
+    /* a line for dithered gray outputs */
+    if (opened == o->num_outputs && o->dither) {
+        row = malloc(h->width * sizeof(struct pixel));
+        
+        if (row == NULL) {
+            printf("Memory allocation failed (25)");
+            ok = 0;
+        }
+    }
+    
+    if (ok && opened == o->num_outputs && o->layout != UNSET) {
+        ok = write_tiles(buf, o, h);
+    } else if (ok && opened == o->num_outputs) {
+        for (line = 0; line < h->height; line++) {
+            for (i = 0; i < o->num_outputs; i++) {
+                if (o->outputs[i].pixfmt->pack == NULL) continue;
+                
+                if (o->outputs[i].dither) {
+                    for (x = 0; x < h->width; x++) {
+                        dither_gray(&o->outputs[i], buf + line * h->width + x, row + x, x, h->height - 1 - line);
+                    }
+                    write_row(&o->outputs[i], row, h->width);
+                } else {
+                    write_row(&o->outputs[i], buf + line * h->width, h->width);
+                }
+                
+                if (o->outputs[i].stride > 0) end_row(&o->outputs[i], o, line, h->height);
+            }
+        }
+        
+        /* page outputs need 8 lines at a time, from the top,
+         * planar outputs two lines at a time and the whole chroma
+         */
+        for (i = 0; i < o->num_outputs; i++) {
+            if (o->outputs[i].pixfmt->packing == PACKING_PAGED) {
+                if (! write_pages(&o->outputs[i], buf, h, o)) ok = 0;
+            } else if (o->outputs[i].pixfmt->pack == NULL) {
+                if (! write_planes(&o->outputs[i], buf, h)) ok = 0;
+            }
+        }
+    }
+    
+    ok = ok && opened == o->num_outputs;
+    
+    for (i = 0; i < opened; i++) {
+        if (! close_output(&o->outputs[i], o, ok)) ok = 0;
+    }
+    
+    free(row);
+    
+    return ok;
+}
+
+/* Write the pixel buffer to all outputs in tiles (-layout). The tiles
+ * go left to right and then down, in the row order of the other
+ * layouts, and each starts at a byte. Inside a tile the pixels go row
+ * by row or in Morton (Z) order: the bits of the x and y coordinate
+ * interleaved. Pixels of edge tiles outside the image are zero.
+ * A band of tile rows is read for all tiles of the band while it is
+ * in the cache and every tile is gathered once for all outputs.
+ *
+ * Arguments:   buf:     pointer to array of pixel structures
+ *              o:       pointer to options structure
+ *              h:       pointer to bmp_header structure
+ *
+ * Return:      0 if memory allocation failed
+ */
+int write_tiles(struct pixel *buf, struct options *o, struct bmp_header *h)
+{
+    unsigned int tw = o->tile_width, th = o->tile_height, size = tw * th;
+    unsigned int tx, ty, x, y, k, n, bit, len;
+    unsigned int *order;
+    struct pixel *tile, *dithered, *src, *pix;
+    int i;
+    
+    /* the tile, and the tile dithered for a gray output */
+    tile = malloc(2 * size * sizeof(struct pixel));
+    order = malloc(size * sizeof(unsigned int));
+    
+    if (tile == NULL || order == NULL) {
+        printf("Memory allocation failed (19)");
+        free(tile);
+        free(order);
+        return 0;
+    }
+    
+    dithered = tile + size;
+    
+    /* position in the tile of every pixel of the tile, in output order */
+    for (k = 0, n = 0; n < size; k++) {
+        if (o->layout == LAYOUT_TILED) {
+            order[n++] = k;
+            continue;
+        }
+        
+        for (bit = 0, x = 0, y = 0; bit < 8; bit++) {
+            x |= ((k >> (2 * bit)) & 1) << bit;
+            y |= ((k >> (2 * bit + 1)) & 1) << bit;
+        }
+        
+        if (x < tw && y < th) order[n++] = y * tw + x;
+    }
+    
+    for (ty = 0; ty < h->height; ty += th) {
+        for (tx = 0; tx < h->width; tx += tw) {
+            for (n = 0; n < size; n++) {
+                x = tx + order[n] % tw;
+                y = ty + order[n] / tw;
+                pix = &tile[n];
+                
+                if (x < h->width && y < h->height) {
+                    *pix = buf[y * h->width + x];
+                } else {
+                    memset(pix, 0, sizeof(struct pixel));
+                }
+            }
+            
+            /* at most a line of pixels at a time, the size of the packing buffers */
+            for (i = 0; i < o->num_outputs; i++) {
+                src = tile;
+                
+                if (o->outputs[i].dither) {
+                    for (n = 0; n < size; n++) {
+                        dither_gray(&o->outputs[i], &tile[n], &dithered[n], tx + order[n] % tw,
+                                    h->height - 1 - (ty + order[n] / tw));
+                    }
+                    src = dithered;
+                }
+                
+                for (n = 0; n < size; n += len) {
+                    len = (size - n < h->width) ? size - n : h->width;
+                    write_output(&o->outputs[i], src + n, len);
+                }
+                
+                flush_output(&o->outputs[i]);
+            }
+        }
+    }
+    
+    free(tile);
+    free(order);
+    
+    return 1;
+}
+
+/* Number of bytes needed for n packed pixels, a YUV 4:2:2 macropixel
+ * is always whole
+ * 
+ * Arguments:   f:       pointer to pixel format
+ *              n:       number of pixels
+ * 
+ * Return:      number of bytes
+ */
+unsigned long packed_size(struct pixfmt *f, unsigned long n)
+{
+    if (f->packing == PACKING_YUV422) return (n + 1) / 2 * f->unit_bytes;
+    
+    return (n / f->unit_pixels) * f->unit_bytes
+           + ((n % f->unit_pixels) * f->bpp + 7) / 8;
+}
+
+/* Check if the rows of a pixel format start at a new packing unit
+ * also without -stride: gray rows start at a byte, as e-paper and gray
+ * OLED controllers address them, and a YUV 4:2:2 macropixel never takes
+ * pixels of two rows, the last single pixel of a row is repeated.
+ * 
+ * Arguments:   f:       pointer to pixel format
+ * 
+ * Return:      1 if every row starts at a new unit
+ */
+int row_aligned(struct pixfmt *f)
+{
+    return f->packing == PACKING_YUV422 || f->packing == PACKING_GRAY;
+}
+
+/* Write a row of pixels to an output, see row_aligned().
+ * 
+ * Arguments:   out:     pointer to output structure
+ *              pix:     pointer to array of pixel structures
+ *              n:       number of pixels in the row
+ * 
+ * Return:      nothing
+ */
+void write_row(struct output *out, struct pixel *pix, int n)
+{
+    write_output(out, pix, n);
+    
+    if (row_aligned(out->pixfmt)) flush_output(out);
+}
+
+/* Number of bytes of an image with rows that are not padded, also
+ * for 1 bit pages, YUV planes and rows that start at a unit
+ * 
+ * Arguments:   f:       pointer to pixel format
+ *              width:   image width
+ *              height:  image height
+ * 
+ * Return:      number of bytes
+ */
+unsigned long image_size(struct pixfmt *f, unsigned int width, unsigned int height)
+{
+    if (f->packing == PACKING_PAGED) return (unsigned long)width * ((height + 7) / 8);
+    
+    if (f->pack == NULL) return (unsigned long)width * height + 2UL * ((width + 1) / 2) * ((height + 1) / 2);
+    
+    if (row_aligned(f)) return packed_size(f, width) * height;
+    
+    return packed_size(f, (unsigned long)width * height);
+}
+
+/* Write the pixels that wait for the rest of their packing unit,
+ * so the next pixels start at a new byte.
+ * 
+ * Arguments:   out:     pointer to output structure
+ * 
+ * Return:      nothing
+ */
+void flush_output(struct output *out)
+{
+    int len;
+    
+    if (out->pending_pixels > 0) {
+        len = pack_output(out, out->pending, out->pending_pixels, out->buf);
+        emit_bytes(out, out->buf, len, 1);
+        out->pending_pixels = 0;
+    }
+}
+
+/* Write a 16 bit little endian value to an output file.
+ * 
+ * Arguments:   out:     pointer to output structure
+ *              v:       value to write
+ * 
+ * Return:      nothing
+ */
+void emit_u16(struct output *out, unsigned int v)
+{
+    unsigned char b[2];
+    
+    b[0] = v & 0xFF;
+    b[1] = (v >> 8) & 0xFF;
+    emit_bytes(out, b, 2, 0);
+}
+
+/* Find the changed areas between two packed frames.
+ * The frame is divided in tiles of TILE_SIZE x TILE_SIZE pixels,
+ * horizontal runs of changed tiles become a rectangle and rectangles
+ * of the same width directly on top of each other are merged.
+ * 
+ * Arguments:   f:       pointer to pixel format of the packed frames
+ *              prev:    previous packed frame
+ *              cur:     current packed frame
+ *              w:       frame width
+ *              h:       frame height
+ *              rects:   array to save the rectangles in, one per tile
+ * 
+ * Return:      number of rectangles
+ */
+int find_dirty_rects(struct pixfmt *f, unsigned char *prev, unsigned char *cur,
+                     unsigned int w, unsigned int h, struct rect *rects)
+{
+    unsigned int tx, ty, tiles, x0, x1, y, y0, y1, row_bytes;
+    unsigned int start, end, run_start;
+    int n = 0, above = 0, above_end = 0, i, merged, dirty;
+    
+    row_bytes = packed_size(f, w);
+    tiles = (w + TILE_SIZE - 1) / TILE_SIZE;
+    
+    for (ty = 0; ty * TILE_SIZE < h; ty++) {
+        y0 = ty * TILE_SIZE;
+        y1 = y0 + TILE_SIZE;
+        if (y1 > h) y1 = h;
+        
+        run_start = w;
+        
+        /* one tile past the last tile to end the last run */
+        for (tx = 0; tx <= tiles; tx++) {
+            dirty = 0;
+            
+            x0 = tx * TILE_SIZE;
+            x1 = x0 + TILE_SIZE;
+            if (x0 > w) x0 = w;
+            if (x1 > w) x1 = w;
+            
+            /* a tile is unchanged when all its packed bytes are equal */
+            if (tx < tiles) {
+                start = packed_size(f, x0);
+                end = packed_size(f, x1);
+                
+                for (y = y0; y < y1 && ! dirty; y++) {
+                    dirty = memcmp(prev + y * row_bytes + start,
+                                   cur + y * row_bytes + start, end - start) != 0;
+                }
+            }
+            
+            if (dirty && run_start == w) {
+                run_start = x0;
+            } else if (! dirty && run_start != w) {
+                
+                /* end of a run, extend a rectangle of the tile row above */
+                merged = 0;
+                
+                for (i = above; i < above_end; i++) {
+                    if (rects[i].x == run_start && rects[i].w == x0 - run_start
+                        && rects[i].y + rects[i].h == y0) {
+                        rects[i].h = y1 - rects[i].y;
+                        merged = 1;
+                        break;
+                    }
+                }
+                
+                if (! merged) {
+                    rects[n].x = run_start;
+                    rects[n].y = y0;
+                    rects[n].w = x0 - run_start;
+                    rects[n].h = y1 - y0;
+                    n++;
+                }
+                
+                run_start = w;
+            }
+        }
+        
+        /* only rectangles that reach this tile row can be extended */
+        for (i = 0, above = n; i < n; i++) {
+            if (rects[i].y + rects[i].h == y1 && i < above) above = i;
+        }
+        above_end = n;
+    }
+    
+    return n;
+}
+
+/* Read a frame of the sequence, or the input image if there is no sequence
+ * 
+ * Arguments:   o:       pointer to options structure
+ *              frame:   frame number
+ *              h:       pointer to bmp_header structure to save the header in
+ * 
+ * Return:      pointer to pixel buffer or NULL if reading failed
+ */
+struct pixel *read_frame(struct options *o, int frame, struct bmp_header *h)
+{
+    char *file;
+    struct pixel *pixbuf;
+    
+    if (o->sequence == NULL) return read_bmp(o->input_file, h);
+    
+    file = malloc(strlen(o->sequence) + 16);
+    
+    if (file == NULL) {
+        printf("Memory allocation failed (8)");
+        return NULL;
+    }
+    
+    sprintf(file, o->sequence, o->first_frame + frame);
+    pixbuf = read_bmp(file, h);
+    free(file);
+    
+    return pixbuf;
+}
+
+/* Write a sequence of frames to all requested outputs.
+ * Every frame is a list of changed rectangles with their pixel data,
+ * keyframes are a single rectangle covering the whole frame.
+ * 
+ * Raw output:    u16 width, u16 height, u16 frames, u16 keyframe interval
+ *                then for every frame:
+ *                u16 rectangles, for every rectangle:
+ *                u16 x, u16 y, u16 width, u16 height, packed pixels
+ * C array:       the same frame records, one array per frame, and an
+ *                array of pointers to the frames.
+ * All numbers are little endian, y counts lines in the order of the
+ * pixel data (BMP lines are stored bottom up).
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int create_sequence(struct options *o)
+{
+    struct bmp_header h, first;
+    struct pixel *pixbuf;
+    struct output *out;
+    unsigned char *tmp;
+    unsigned long frame_start;
+    unsigned int row, r;
+    int i, frame, n, opened, failed = 0, ok;
+    char name[64];
+    
+    pixbuf = read_frame(o, 0, &first);
+    if (pixbuf == NULL) return 0;
+    
+    if (first.width > 0xFFFF || first.height > 0xFFFF) {
+        printf("sequence frames can be at most 65535x65535 pixels\n");
+        free(pixbuf);
+        return 0;
+    }
+    
+    for (i = 0; i < o->num_outputs; i++) {
+        if (o->outputs[i].pixfmt->pack == NULL) {
+            printf("%s can not be used for a sequence\n", o->outputs[i].pixfmt->name);
+            free(pixbuf);
+            return 0;
+        }
+    }
+    
+    for (opened = 0; opened < o->num_outputs; opened++) {
+        out = &o->outputs[opened];
+        
+        if (! open_output(out, o, &first, first.width * first.height)) {
+            failed = 1;
+            break;
+        }
+        
+        out->row_bytes = packed_size(out->pixfmt, first.width);
+        out->prev = malloc(out->row_bytes * first.height);
+        out->cur = malloc(out->row_bytes * first.height);
+        out->rects = malloc(sizeof(struct rect) * (first.width / TILE_SIZE + 1) * (first.height / TILE_SIZE + 1));
+        
+        if (out->prev == NULL || out->cur == NULL || out->rects == NULL) {
+            printf("Memory allocation failed (9)");
+            failed = 1;
+            opened++;
+            break;
+        }
+        
+        if (out->format == FORMAT_CARRAY) {
+            fprintf(out->fp, "/* Sequence of %d frames of %ux%u pixels, keyframe interval %d.\n", o->frames, first.width, first.height, o->keyframe);
+            fprintf(out->fp, " * Each pixel has %s.\n", out->pixfmt->layout);
+            fprintf(out->fp, " * Each frame: u16 rectangles, for every rectangle\n");
+            fprintf(out->fp, " * u16 x, u16 y, u16 width, u16 height and its pixels.\n");
+            fprintf(out->fp, " * All numbers are little endian.\n");
+            fprintf(out->fp, " */\n");
+        } else {
+            emit_u16(out, first.width);
+            emit_u16(out, first.height);
+            emit_u16(out, o->frames);
+            emit_u16(out, o->keyframe);
+        }
+    }
+    
+    for (frame = 0; ! failed && frame < o->frames; frame++) {
+        
+        if (frame > 0) {
+            free(pixbuf);
+            pixbuf = read_frame(o, frame, &h);
+            if (pixbuf == NULL) break;
+            
+            if (h.width != first.width || h.height != first.height) {
+                printf("frame %d is %ux%u, expected %ux%u\n", frame, h.width, h.height, first.width, first.height);
+                break;
+            }
+        }
+        
+        for (i = 0; i < o->num_outputs; i++) {
+            out = &o->outputs[i];
+            
+            /* pack every line on its own so lines start at a byte */
+            for (row = 0; row < first.height; row++) {
+                pack_output(out, pixbuf + row * first.width, first.width, out->cur + row * out->row_bytes);
+            }
+            
+            if (frame == 0 || (o->keyframe > 0 && (frame % o->keyframe) == 0)) {
+                out->rects[0].x = 0;
+                out->rects[0].y = 0;
+                out->rects[0].w = first.width;
+                out->rects[0].h = first.height;
+                n = 1;
+            } else {
+                n = find_dirty_rects(out->pixfmt, out->prev, out->cur, first.width, first.height, out->rects);
+            }
+            
+            if (out->format == FORMAT_CARRAY) {
+                fprintf(out->fp, "\n/* frame %d: %d rectangles */\n", frame, n);
+                sprintf(name, "%.50s_f%d", out->arrayname, frame);
+                begin_array(out, o, name, frame);
+                out->bytes = 0;
+            }
+            
+            frame_start = out->bytes;
+            emit_u16(out, n);
+            
+            for (r = 0; r < (unsigned int)n; r++) {
+                emit_u16(out, out->rects[r].x);
+                emit_u16(out, out->rects[r].y);
+                emit_u16(out, out->rects[r].w);
+                emit_u16(out, out->rects[r].h);
+                
+                for (row = out->rects[r].y; row < out->rects[r].y + out->rects[r].h; row++) {
+                    write_row(out, pixbuf + row * first.width + out->rects[r].x, out->rects[r].w);
+                }
+                
+                flush_output(out);
+            }
+            
+            if (out->format == FORMAT_CARRAY) {
+                fprintf(out->fp, "\n};\n");
+            }
+            
+            if (o->verbose == VERBOSE) {
+                printf("%s frame %d: %d rectangles, %lu bytes\n", out->file, frame, n, out->bytes - frame_start);
+            }
+            
+            tmp = out->prev;
+            out->prev = out->cur;
+            out->cur = tmp;
+        }
+    }
+    
+    ok = (! failed && frame == o->frames);
+    
+    for (i = 0; i < opened; i++) {
+        out = &o->outputs[i];
+        
+        if (out->format == FORMAT_CARRAY && ok) {
+            fprintf(out->fp, "\n%sunsigned char *%s[%d] = {", o->constant ? "const " : "", out->arrayname, o->frames);
+            
+            for (frame = 0; frame < o->frames; frame++) {
+                fprintf(out->fp, "%s%s_f%d,", (frame % 4) ? " " : "\n\t", out->arrayname, frame);
+            }
+            
+            fprintf(out->fp, "\n};");
+        }
+        
+        if (! close_replace(out->fp, out->file, out->tmp_file, ok)) ok = 0;
+        free(out->buf);
+        free(out->lut);
+        free(out->prev);
+        free(out->cur);
+        free(out->rects);
+    }
+    
+    free(pixbuf);
+    
+    return ok;
+}
+
+/* Check that a sequence file name pattern has exactly one
+ * %d conversion (optionally with zero padding, like %03d).
+ * 
+ * Arguments:   pattern: file name pattern
+ * 
+ * Return:      1 if the pattern is valid
+ */
+int is_sequence_pattern(char *pattern)
+{
+    int conversions = 0;
+    
+    for (; *pattern != '\0'; pattern++) {
+        if (*pattern != '%') continue;
+        
+        pattern++;
+        while (isdigit((unsigned char)*pattern)) pattern++;
+        
+        if (*pattern != 'd') return 0;
+        conversions++;
+    }
+    
+    return conversions == 1;
+}
+
+/* Write a 16 bit little endian value to a file.
+ * 
+ * Arguments:   fp:      pointer to file descriptor
+ *              v:       value to write
+ * 
+ * Return:      nothing
+ */
+void put_u16(FILE *fp, unsigned int v)
+{
+    fputc(v & 0xFF, fp);
+    fputc((v >> 8) & 0xFF, fp);
+}
+
+/* Write a 32 bit little endian value to a file.
+ * 
+ * Arguments:   fp:      pointer to file descriptor
+ *              v:       value to write
+ * 
+ * Return:      nothing
+ */
+void put_u32(FILE *fp, unsigned long v)
+{
+    put_u16(fp, v & 0xFFFF);
+    put_u16(fp, (v >> 16) & 0xFFFF);
+}
+
+/* Get a 16 bit little endian value from a buffer.
+ * 
+ * Arguments:   b:       pointer to the first byte
+ * 
+ * Return:      the value
+ */
+unsigned int get_u16(unsigned char *b)
+{
+    return b[0] | (b[1] << 8);
+}
+
+/* Get a 32 bit little endian value from a buffer.
+ * 
+ * Arguments:   b:       pointer to the first byte
+ * 
+ * Return:      the value
+ */
+unsigned long get_u32(unsigned char *b)
+{
+    return get_u16(b) | ((unsigned long)get_u16(b + 2) << 16);
+}
+
+/* Pixel format of the -format/-bpp/-pixfmt options
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      pointer to pixel format
+ */
+struct pixfmt *default_pixfmt(struct options *o)
+{
+    char bpp[8];
+    
+    if (o->pixfmt != NULL) return find_pixfmt(o->pixfmt);
+    
+    sprintf(bpp, "%d", o->bpp);
+    return find_pixfmt(bpp);
+}
+
+/* Write the images of a sequence (or the input image) to a container.
+ * 
+ * Layout, all numbers little endian:
+ *   header:   "BMPC", u16 version, u16 header size,
+ *             u32 frames, u16 alignment, u16 index entry size
+ *   index:    for every frame: u32 offset, u32 size, u16 width,
+ *             u16 height, u8 pixel format, u8 bpp, u16 reserved
+ *   payloads: raw packed pixels of every frame, each starting at
+ *             a multiple of the alignment from the start of the file
+ * Frame i is found at offset CONTAINER_HEADER_SIZE + i * CONTAINER_ENTRY_SIZE.
+ * The pixel format is the position of the format in PIXFMT_LIST.
+ * 
+ * The frames are read and written one by one, only the index
+ * is kept in memory and written when all frames are done.
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int create_container(struct options *o)
+{
+    struct output out;
+    struct bmp_header h;
+    struct pixel *pixbuf;
+    unsigned char *index, *e;
+    unsigned long offset;
+    unsigned int row;
+    int frames, frame, ok = 0;
+    
+    frames = (o->sequence != NULL) ? o->frames : 1;
+    
+    memset(&out, 0, sizeof(out));
+    out.format = FORMAT_RAW;
+    out.pixfmt = default_pixfmt(o);
+    
+    if (out.pixfmt->pack == NULL) {
+        printf("%s can not be used in a container\n", out.pixfmt->name);
+        return 0;
+    }
+    
+    if (! build_lut(&out, o)) return 0;
+    
+    index = calloc(frames, CONTAINER_ENTRY_SIZE);
+    
+    if (index == NULL) {
+        printf("Memory allocation failed (10)");
+        free(out.lut);
+        return 0;
+    }
+    
+    out.fp = open_replace(o->container, "wb+", &out.tmp_file);
+    
+    if (out.fp == NULL) {
+        printf("Failed open output file %s\n", o->container);
+        free(out.lut);
+        free(index);
+        return 0;
+    }
+    
+    fwrite("BMPC", 1, 4, out.fp);
+    put_u16(out.fp, CONTAINER_VERSION);
+    put_u16(out.fp, CONTAINER_HEADER_SIZE);
+    put_u32(out.fp, frames);
+    put_u16(out.fp, o->align);
+    put_u16(out.fp, CONTAINER_ENTRY_SIZE);
+    
+    /* the index is written again when all frames are done */
+    fwrite(index, CONTAINER_ENTRY_SIZE, frames, out.fp);
+    offset = CONTAINER_HEADER_SIZE + (unsigned long)frames * CONTAINER_ENTRY_SIZE;
+    
+    for (frame = 0; frame < frames; frame++) {
+        pixbuf = read_frame(o, frame, &h);
+        if (pixbuf == NULL) break;
+        
+        if (h.width > 0xFFFF || h.height > 0xFFFF) {
+            printf("frame %d is larger than 65535x65535 pixels\n", frame);
+            free(pixbuf);
+            break;
+        }
+        
+        out.buf = malloc(h.width * 4 + 4);
+        
+        if (out.buf == NULL) {
+            printf("Memory allocation failed (11)");
+            free(pixbuf);
+            break;
+        }
+        
+        /* pad to the alignment of the payload */
+        while (offset % o->align != 0) {
+            fputc(0, out.fp);
+            offset++;
+        }
+        
+        out.bytes = 0;
+        
+        for (row = 0; row < h.height; row++) {
+            write_row(&out, pixbuf + row * h.width, h.width);
+        }
+        
+        flush_output(&out);
+        
+        e = index + frame * CONTAINER_ENTRY_SIZE;
+        e[0] = offset & 0xFF;
+        e[1] = (offset >> 8) & 0xFF;
+        e[2] = (offset >> 16) & 0xFF;
+        e[3] = (offset >> 24) & 0xFF;
+        e[4] = out.bytes & 0xFF;
+        e[5] = (out.bytes >> 8) & 0xFF;
+        e[6] = (out.bytes >> 16) & 0xFF;
+        e[7] = (out.bytes >> 24) & 0xFF;
+        e[8] = h.width & 0xFF;
+        e[9] = (h.width >> 8) & 0xFF;
+        e[10] = h.height & 0xFF;
+        e[11] = (h.height >> 8) & 0xFF;
+        e[12] = out.pixfmt - pixfmts;
+        e[13] = out.pixfmt->bpp;
+        
+        if (o->verbose == VERBOSE) {
+            printf("frame %d: %ux%u, offset %lu, %lu bytes\n", frame, h.width, h.height, offset, out.bytes);
+        }
+        
+        offset += out.bytes;
+        free(out.buf);
+        free(pixbuf);
+    }
+    
+    if (frame == frames) {
+        fseek(out.fp, CONTAINER_HEADER_SIZE, SEEK_SET);
+        fwrite(index, CONTAINER_ENTRY_SIZE, frames, out.fp);
+        ok = 1;
+    }
+    
+    if (! close_replace(out.fp, o->container, out.tmp_file, ok)) ok = 0;
+    free(out.lut);
+    free(index);
+    
+    return ok;
+}
+
+/* Read a container, check it and print its index.
+ * 
+ * Arguments:   file:    path of the container
+ * 
+ * Return:      0 if the container is not valid
+ */
+int check_container(char *file)
+{
+    FILE *fp;
+    unsigned char hdr[CONTAINER_HEADER_SIZE], e[CONTAINER_ENTRY_SIZE];
+    unsigned long frames, frame, size, offset, end, file_size;
+    unsigned int align, width, height;
+    int errors = 0;
+    struct pixfmt *f;
+    
+    fp = fopen(file, "rb");
+    
+    if (fp == NULL) {
+        printf("Failed to open file %s\n", file);
+        return 0;
+    }
+    
+    fseek(fp, 0, SEEK_END);
+    file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    if (fread(hdr, 1, CONTAINER_HEADER_SIZE, fp) != CONTAINER_HEADER_SIZE
+        || memcmp(hdr, "BMPC", 4) != 0) {
+        printf("%s is not a bmpdump container\n", file);
+        fclose(fp);
+        return 0;
+    }
+    
+    frames = get_u32(hdr + 8);
+    align = get_u16(hdr + 12);
+    
+    if (get_u16(hdr + 4) != CONTAINER_VERSION
+        || get_u16(hdr + 6) != CONTAINER_HEADER_SIZE
+        || get_u16(hdr + 14) != CONTAINER_ENTRY_SIZE) {
+        printf("%s: unsupported container version\n", file);
+        fclose(fp);
+        return 0;
+    }
+    
+    printf("%s: %lu frames, alignment %u, %lu bytes\n", file, frames, align, file_size);
+    
+    end = CONTAINER_HEADER_SIZE + frames * CONTAINER_ENTRY_SIZE;
+    
+    if (end > file_size) {
+        printf("index does not fit in the file\n");
+        fclose(fp);
+        return 0;
+    }
+    
+    for (frame = 0; frame < frames; frame++) {
+        fread(e, 1, CONTAINER_ENTRY_SIZE, fp);
+        
+        offset = get_u32(e);
+        size = get_u32(e + 4);
+        width = get_u16(e + 8);
+        height = get_u16(e + 10);
+        f = (e[12] < NUM_PIXFMTS) ? &pixfmts[e[12]] : NULL;
+        
+        printf("frame %lu: offset %lu, %lu bytes, %ux%u, %s\n", frame, offset, size,
+               width, height, (f != NULL) ? f->name : "unknown pixel format");
+        
+        if (f == NULL || f->bpp != e[13]) {
+            printf("  invalid pixel format %u (%u bpp)\n", e[12], e[13]);
+            errors++;
+        } else if (size != image_size(f, width, height)) {
+            printf("  size should be %lu bytes\n", image_size(f, width, height));
+            errors++;
+        }
+        
+        if (align == 0 || offset % align != 0) {
+            printf("  offset is not aligned\n");
+            errors++;
+        }
+        
+        if (offset < end) {
+            printf("  overlaps the previous frame or the index\n");
+            errors++;
+        }
+        
+        if (offset + size > file_size) {
+            printf("  ends after the end of the file\n");
+            errors++;
+        }
+        
+        end = offset + size;
+    }
+    
+    fclose(fp);
+    
+    printf("%d errors\n", errors);
+    
+    return errors == 0;
+}
+
+/* Value of a glyph sheet pixel. For coverage glyphs (-glyphbits) the
+ * coverage with glyph_bits bits: the alpha channel on a transparent sheet,
+ * otherwise the luminance, inverted on a light background. For color
+ * glyphs 1 if the pixel differs from the background. 0 is empty.
+ * 
+ * Arguments:   p:       pointer to the pixel
+ *              bg:      pointer to the background pixel
+ *              o:       pointer to options structure
+ * 
+ * Return:      pixel value
+ */
+unsigned int glyph_value(struct pixel *p, struct pixel *bg, struct options *o)
+{
+    unsigned int c;
+    
+    if (o->glyph_bits == UNSET) {
+        return p->r != bg->r || p->g != bg->g || p->b != bg->b || p->a != bg->a;
+    }
+    
+    if (bg->a < 0xFF) {
+        c = p->a;
+    } else {
+        c = (77 * p->r + 150 * p->g + 29 * p->b) >> 8;
+        if (((77 * bg->r + 150 * bg->g + 29 * bg->b) >> 8) >= 128) c = 255 - c;
+        c = c * p->a / 255;
+    }
+    
+    if (o->glyph_bits == 1) return c >= (unsigned int)o->threshold;
+    
+    return (c * ((1 << o->glyph_bits) - 1) + 127) / 255;
+}
+
+/* Slice a glyph sheet into a font.
+ * 
+ * The sheet is a grid of cell_width x cell_height cells, the first cell
+ * (top left) holds first_char, the next cells to the right and then on
+ * the next rows hold the next characters. The color of the top left pixel
+ * is the background. Every glyph is trimmed to the bounding box of its
+ * non background pixels and written line by line from the top, starting
+ * at a new byte, in the output pixel format or as coverage (-glyphbits).
+ * 
+ * A table with one entry per character follows the glyph data, so the
+ * glyph of character c is <name>_glyphs[c - <NAME>_FIRST]. x and y are
+ * the position of the glyph in its cell (0 with -proportional) and the
+ * cursor moves advance pixels: the cell width, or with -proportional
+ * the glyph width plus the spacing (half a cell for empty glyphs).
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int create_font(struct options *o)
+{
+    struct output *out = &o->outputs[0];
+    struct bmp_header h;
+    struct pixel *pixbuf, *row, bg;
+    struct glyph *glyphs, *g;
+    unsigned int cols, x, y, x0, y0, x1, y1, v, nbits;
+    unsigned char acc;
+    long count, i;
+    char name[64];
+    
+    if (out->format != FORMAT_CARRAY) {
+        printf("a font can only be written as C array\n");
+        return 0;
+    }
+    
+    if (o->glyph_bits == UNSET && out->pixfmt->pack == NULL) {
+        printf("%s can not be used for a font, use -glyphbits 1\n", out->pixfmt->name);
+        return 0;
+    }
+    
+    pixbuf = read_bmp(o->input_file, &h);
+    if (pixbuf == NULL) return 0;
+    
+    cols = h.width / o->cell_width;
+    count = o->last_char - o->first_char + 1;
+    
+    if (count > (long)cols * (h.height / o->cell_height)) {
+        printf("%ld characters do not fit in the %ux%u cells of the glyph sheet\n",
+               count, cols, h.height / o->cell_height);
+        free(pixbuf);
+        return 0;
+    }
+    
+    glyphs = malloc(count * sizeof(struct glyph));
+    
+    if (glyphs == NULL) {
+        printf("Memory allocation failed (15)");
+        free(pixbuf);
+        return 0;
+    }
+    
+    if (! open_output(out, o, &h, h.width * h.height)) {
+        free(glyphs);
+        free(pixbuf);
+        return 0;
+    }
+    
+    fprintf(out->fp, "/* Font with %ld glyphs (characters %ld to %ld) from %ux%u cells.\n",
+            count, o->first_char, o->last_char, o->cell_width, o->cell_height);
+    fprintf(out->fp, " * Each glyph is trimmed and stored line by line from the top,\n");
+    fprintf(out->fp, " * starting at a new byte, see %s_glyphs[].\n", out->arrayname);
+    
+    if (o->glyph_bits == UNSET) {
+        fprintf(out->fp, " * Each pixel has %s.\n", out->pixfmt->layout);
+    } else {
+        fprintf(out->fp, " * Each pixel has %d bit coverage, first pixel in the most significant bits.\n", o->glyph_bits);
+    }
+    
+    fprintf(out->fp, " */\n");
+    begin_array(out, o, out->arrayname, 0);
+    
+    /* the top left pixel of the sheet, BMP lines are stored bottom up */
+    bg = pixbuf[(h.height - 1) * h.width];
+    
+    for (i = 0; i < count; i++) {
+        g = &glyphs[i];
+        x0 = (i % cols) * o->cell_width;
+        y0 = (i / cols) * o->cell_height;
+        
+        /* bounding box in the cell, empty if x1 < g->x */
+        g->x = o->cell_width;
+        g->y = o->cell_height;
+        x1 = y1 = 0;
+        
+        for (y = 0; y < o->cell_height; y++) {
+            row = pixbuf + (h.height - 1 - y0 - y) * h.width + x0;
+            
+            for (x = 0; x < o->cell_width; x++) {
+                if (glyph_value(&row[x], &bg, o) == 0) continue;
+                
+                if (x < g->x) g->x = x;
+                if (y < g->y) g->y = y;
+                if (x >= x1) x1 = x + 1;
+                if (y >= y1) y1 = y + 1;
+            }
+        }
+        
+        if (x1 == 0) g->x = g->y = x1 = y1 = 0;
+        
+        g->width = x1 - g->x;
+        g->height = y1 - g->y;
+        g->offset = out->bytes;
+        g->advance = o->cell_width;
+        
+        if (o->proportional) {
+            g->advance = (g->width > 0) ? g->width + o->spacing : o->cell_width / 2;
+            g->x = 0;
+        }
+        
+        acc = 0;
+        nbits = 0;
+        
+        for (y = y0 + y1 - g->height; y < y0 + y1; y++) {
+            row = pixbuf + (h.height - 1 - y) * h.width + x0 + x1 - g->width;
+            
+            if (o->glyph_bits == UNSET) {
+                write_row(out, row, g->width);
+                continue;
+            }
+            
+            for (x = 0; x < g->width; x++) {
+                v = glyph_value(&row[x], &bg, o);
+                acc = (acc << o->glyph_bits) | v;
+                nbits += o->glyph_bits;
+                
+                if (nbits == 8) {
+                    emit_bytes(out, &acc, 1, 0);
+                    acc = 0;
+                    nbits = 0;
+                }
+            }
+        }
+        
+        if (nbits > 0) {
+            acc <<= 8 - nbits;
+            emit_bytes(out, &acc, 1, 0);
+        }
+        
+        flush_output(out);
+    }
+    
+    fprintf(out->fp, "\n};\n\n");
+    
+    macro_name(name, out->arrayname, sizeof(name));
+    
+    fprintf(out->fp, "#define %s_FIRST %ld\n", name, o->first_char);
+    fprintf(out->fp, "#define %s_LAST %ld\n\n", name, o->last_char);
+    fprintf(out->fp, "/* A glyph of %s[]: offset of its first byte, size,\n", out->arrayname);
+    fprintf(out->fp, " * position in the cell and cursor advance in pixels.\n");
+    fprintf(out->fp, " */\n");
+    fprintf(out->fp, "struct %s_glyph {\n", out->arrayname);
+    fprintf(out->fp, "\tunsigned %s offset;\n", (out->bytes > 0xFFFF) ? "long" : "short");
+    fprintf(out->fp, "\tunsigned char width;\n");
+    fprintf(out->fp, "\tunsigned char height;\n");
+    fprintf(out->fp, "\tunsigned char x;\n");
+    fprintf(out->fp, "\tunsigned char y;\n");
+    fprintf(out->fp, "\tunsigned char advance;\n");
+    fprintf(out->fp, "};\n\n");
+    fprintf(out->fp, "%sstruct %s_glyph %s_glyphs[] = {\n", o->constant ? "const " : "", out->arrayname, out->arrayname);
+    
+    for (i = 0; i < count; i++) {
+        g = &glyphs[i];
+        fprintf(out->fp, "\t{ %lu, %u, %u, %u, %u, %u },", g->offset, g->width,
+                g->height, g->x, g->y, g->advance);
+        
+        if (o->first_char + i < 128 && isprint((int)(o->first_char + i))) {
+            fprintf(out->fp, "\t/* %ld '%c' */\n", o->first_char + i, (int)(o->first_char + i));
+        } else {
+            fprintf(out->fp, "\t/* %ld */\n", o->first_char + i);
+        }
+    }
+    
+    fprintf(out->fp, "};");
+    
+    if (o->verbose == VERBOSE) {
+        printf("%ld glyphs, %lu bytes\n", count, out->bytes);
+    }
+    
+    free(out->buf);
+    free(out->lut);
+    free(glyphs);
+    free(pixbuf);
+    
+    return close_replace(out->fp, out->file, out->tmp_file, 1);
+}
+
+/* List the entries of a directory, without . and ..
+ * 
+ * Arguments:   dir:     path of the directory
+ *              n:       set to the number of entries
+ * 
+ * Return:      array of allocated names, NULL if the directory
+ *              could not be read
+ */
+char **list_dir(char *dir, int *n)
+{
+    char **names = NULL, **more, *name;
+    int size = 0;
+#ifdef _WIN32
+    struct _finddata_t fd;
+    intptr_t handle;
+    char pattern[FILENAME_MAX];
+    
+    sprintf(pattern, "%.*s\\*", FILENAME_MAX - 3, dir);
+    handle = _findfirst(pattern, &fd);
+    if (handle == -1) return NULL;
+    
+    do {
+        name = fd.name;
+#else
+    DIR *d;
+    struct dirent *e;
+    
+    d = opendir(dir);
+    if (d == NULL) return NULL;
+    
+    while ((e = readdir(d)) != NULL) {
+        name = e->d_name;
+#endif
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        
+        if (*n == size) {
+            size = size ? size * 2 : 64;
+            more = realloc(names, size * sizeof(char *));
+            if (more == NULL) break;
+            names = more;
+        }
+        
+        names[*n] = malloc(strlen(name) + 1);
+        if (names[*n] == NULL) break;
+        strcpy(names[(*n)++], name);
+#ifdef _WIN32
+    } while (_findnext(handle, &fd) == 0);
+    
+    _findclose(handle);
+#else
+    }
+    
+    closedir(d);
+#endif
+    
+    /* an empty directory still gives a (freeable) list */
+    if (names == NULL) names = malloc(sizeof(char *));
+    
+    return names;
+}
+
+/* qsort() comparison of two names
+ * 
+ * Arguments:   a, b:    pointers to the names
+ * 
+ * Return:      strcmp() of the names
+ */
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Print a string as JSON string, quoted and escaped
+ * 
+ * Arguments:   s:       string to print
+ * 
+ * Return:      nothing
+ */
+void print_json_string(char *s)
+{
+    putchar('"');
+    
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        
+        if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", (unsigned char)*s);
+        } else {
+            putchar(*s);
+        }
+    }
+    
+    putchar('"');
+}
+
+/* Check the header of a BMP image, print a line of the scan report and
+ * add the output sizes to the totals. Only the header is read.
+ * 
+ * Arguments:   path:      path of the image
+ *              file_size: size of the file in bytes
+ *              totals:    output sizes of all valid images, per pixel format
+ *              first:     nonzero for the first image of the report
+ *              o:         pointer to options structure
+ * 
+ * Return:      1 if the image can be converted
+ */
+int scan_file(char *path, long file_size, unsigned long *totals, int first, struct options *o)
+{
+    struct bmp_header h;
+    unsigned long size, row, stored = 0;
+    char *error = NULL, name[8];
+    FILE *fp;
+    int f;
+    
+    memset(&h, 0, sizeof(h));
+    fp = fopen(path, "rb");
+    
+    if (fp == NULL) {
+        error = "can not be opened";
+    } else {
+        get_header(fp, &h, &error);
+        fclose(fp);
+    }
+    
+    /* the pixel data should be in the file */
+    row = ((unsigned long)h.width * (h.bpp / 8) + 3) / 4 * 4;
+    
+    if (error == NULL && h.height > 0 && row > (unsigned long)-1 / 4 / h.height) {
+        error = "image size is too large";
+    } else {
+        stored = row * h.height;
+    }
+    
+    if (error == NULL && (unsigned long)file_size < h.data_offset + stored) {
+        error = "file is truncated";
+    }
+    
+    if (o->json) {
+        printf("%s\n    { \"file\": ", first ? "" : ",");
+        print_json_string(path);
+        
+        if (error != NULL) {
+            printf(", \"valid\": false, \"error\": ");
+            print_json_string(error);
+            printf(" }");
+        } else {
+            printf(", \"valid\": true, \"width\": %u, \"height\": %u, \"bpp\": %u, \"compression\": %u, \"sizes\": {",
+                   h.width, h.height, h.bpp, h.compression);
+        }
+    } else if (error != NULL) {
+        printf("%-40s invalid: %s\n", path, error);
+    } else {
+        printf("%-40s %6u %6u %3u", path, h.width, h.height, h.bpp);
+    }
+    
+    if (error != NULL) return 0;
+    
+    for (f = 0; f < NUM_PIXFMTS; f++) {
+        size = image_size(&pixfmts[f], h.width, h.height);
+        
+        totals[f] += size;
+        sprintf(name, "%d", pixfmts[f].bpp);
+        
+        if (o->json) {
+            printf("%s\"%s\": %lu", f ? ", " : " ", pixfmts[f].name, size);
+        } else if (find_pixfmt(name) == &pixfmts[f]) {
+            printf(" %9lu", size);
+        }
+    }
+    
+    printf(o->json ? " } }" : "\n");
+    
+    return 1;
+}
+
+/* Scan a directory tree for BMP images, in name order.
+ * 
+ * Arguments:   dir:     path of the directory
+ *              totals:  output sizes of all valid images, per pixel format
+ *              files:   incremented for every image
+ *              o:       pointer to options structure
+ * 
+ * Return:      number of valid images
+ */
+int scan_dir(char *dir, unsigned long *totals, int *files, struct options *o)
+{
+    struct stat st;
+    char **names, *path, *ext;
+    int i, n = 0, valid = 0;
+    
+    names = list_dir(dir, &n);
+    
+    if (names == NULL) {
+        printf("Failed to read directory %s\n", dir);
+        return 0;
+    }
+    
+    qsort(names, n, sizeof(char *), compare_names);
+    
+    for (i = 0; i < n; i++) {
+        path = malloc(strlen(dir) + strlen(names[i]) + 2);
+        
+        if (path != NULL) {
+            sprintf(path, "%s/%s", dir, names[i]);
+            ext = strrchr(names[i], '.');
+            
+            if (stat(path, &st) != 0) {
+                /* vanished or unreadable, skip it */
+            } else if (S_ISDIR(st.st_mode)) {
+                valid += scan_dir(path, totals, files, o);
+            } else if (ext != NULL && strlen(ext) == 4 && tolower((unsigned char)ext[1]) == 'b'
+                       && tolower((unsigned char)ext[2]) == 'm' && tolower((unsigned char)ext[3]) == 'p') {
+                (*files)++;
+                valid += scan_file(path, (long)st.st_size, totals, *files == 1, o);
+            }
+            
+            free(path);
+        }
+        
+        free(names[i]);
+    }
+    
+    free(names);
+    
+    return valid;
+}
+
+/* Scan a directory tree and report the size of every BMP image in every
+ * pixel format (the first format of each bpp in the table, all formats
+ * in JSON). Only the headers are read, the pixel data is not decoded.
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if an image is not valid
+ */
+int scan(struct options *o)
+{
+    unsigned long totals[NUM_PIXFMTS];
+    char name[8];
+    int f, files = 0, valid;
+    
+    memset(totals, 0, sizeof(totals));
+    
+    if (o->json) {
+        printf("{\n  \"images\": [");
+    } else {
+        printf("%-40s %6s %6s %3s", "file", "width", "height", "bpp");
+        
+        for (f = 0; f < NUM_PIXFMTS; f++) {
+            sprintf(name, "%d", pixfmts[f].bpp);
+            if (find_pixfmt(name) == &pixfmts[f]) printf(" %5d bit", pixfmts[f].bpp);
+        }
+        
+        printf("\n");
+    }
+    
+    valid = scan_dir(o->scan, totals, &files, o);
+    
+    if (o->json) {
+        printf("\n  ],\n  \"files\": %d,\n  \"valid\": %d,\n  \"totals\": {", files, valid);
+        
+        for (f = 0; f < NUM_PIXFMTS; f++) {
+            printf("%s\"%s\": %lu", f ? ", " : " ", pixfmts[f].name, totals[f]);
+        }
+        
+        printf(" }\n}\n");
+    } else {
+        printf("%-40s %17s", "total", "");
+        
+        for (f = 0; f < NUM_PIXFMTS; f++) {
+            sprintf(name, "%d", pixfmts[f].bpp);
+            if (find_pixfmt(name) == &pixfmts[f]) printf(" %9lu", totals[f]);
+        }
+        
+        printf("\n%d images, %d valid\n", files, valid);
+    }
+    
+    return valid == files;
+}
+
+/* Open a file that replaces its old version only when it is complete:
+ * it is written as <file>.tmp and renamed by close_replace(), so a
+ * compiler or a watching tool never sees a half written file.
+ * A file that is appended to is opened itself.
+ * 
+ * Arguments:   file:    path of the file
+ *              mode:    fopen() mode
+ *              tmp:     pointer to save the path of the temporary file in,
+ *                       NULL if the file is opened itself
+ * 
+ * Return:      file pointer or NULL if failed
+ */
+FILE *open_replace(char *file, char *mode, char **tmp)
+{
+    FILE *fp;
+    
+    *tmp = NULL;
+    
+    if (mode[0] == 'a') return fopen(file, mode);
+    
+    *tmp = malloc(strlen(file) + 5);
+    
+    if (*tmp == NULL) {
+        printf("Memory allocation failed (20)");
+        return NULL;
+    }
+    
+    sprintf(*tmp, "%s.tmp", file);
+    fp = fopen(*tmp, mode);
+    
+    if (fp == NULL) {
+        free(*tmp);
+        *tmp = NULL;
+    }
+    
+    return fp;
+}
+
+/* Close a file opened with open_replace() and put it in place of the
+ * old version, or throw it away if it is not complete.
+ * 
+ * Arguments:   fp:      file pointer
+ *              file:    path of the file
+ *              tmp:     path of the temporary file or NULL
+ *              ok:      0 if the file is not complete
+ * 
+ * Return:      0 if the file is not complete or could not be replaced
+ */
+int close_replace(FILE *fp, char *file, char *tmp, int ok)
+{
+    if (fclose(fp) != 0) ok = 0;
+    if (tmp == NULL) return ok;
+    
+    if (ok) {
+#ifdef _WIN32
+        /* rename() does not replace a file here */
+        remove(file);
+#endif
+        if (rename(tmp, file) != 0) {
+            printf("Failed to replace %s\n", file);
+            ok = 0;
+        }
+    }
+    
+    if (! ok) remove(tmp);
+    free(tmp);
+    
+    return ok;
+}
+
+/* Convert the input with the options, as one run of bmpdump does
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int convert(struct options *o)
+{
+    struct pixel *pixbuf;
+    int ok;
+    
+    /* a container holds whole images or frames */
+    if (o->container != NULL) {
+        return create_container(o);
+    }
+    
+    /* a font is sliced from the input image */
+    if (o->font != NULL) {
+        return create_font(o);
+    }
+    
+    /* a sequence reads its own frames */
+    if (o->sequence != NULL) {
+        return create_sequence(o);
+    }
+    
+    /* get pixel data from BMP image */
+    pixbuf = read_bmp(o->input_file, &header);
+    if (pixbuf == NULL) return 0;
+    
+    /* let the image choose the pixel format of the outputs,
+     * then create the output files, all from this single decode
+     */
+    ok = (o->auto_mode == UNSET || auto_pixfmt(pixbuf, &header, o))
+         && create_outputs(pixbuf, o, &header);
+    
+    free(pixbuf);
+    
+    return ok;
+}
+
+/* File name part of a path, after the last slash or backslash
+ * 
+ * Arguments:   path:    path of a file
+ * 
+ * Return:      pointer into path
+ */
+char *base_name(char *path)
+{
+    char *base = path;
+    
+    for (; *path != '\0'; path++) {
+        if (*path == '/' || *path == '\\') base = path + 1;
+    }
+    
+    return base;
+}
+
+/* Path of the output of an image in a watched directory: the path of
+ * the image with .c or .raw instead of .bmp
+ * 
+ * Arguments:   path:    path of the image
+ *              o:       pointer to options structure
+ * 
+ * Return:      newly allocated path or NULL if allocation failed
+ */
+char *output_path(char *path, struct options *o)
+{
+    char *file, *ext;
+    
+    file = malloc(strlen(path) + 5);
+    if (file == NULL) return NULL;
+    
+    strcpy(file, path);
+    
+    /* only a dot in the file name starts the extension, not one of a directory */
+    ext = strrchr(base_name(file), '.');
+    if (ext == NULL) ext = file + strlen(file);
+    
+    strcpy(ext, (o->outputs[0].format == FORMAT_CARRAY) ? ".c" : ".raw");
+    
+    return file;
+}
+
+/* Convert a watched image again. An image in a watched directory gets
+ * its own output, named after the image, with the name of the image
+ * (letters, digits and _) as array name.
+ * 
+ * Arguments:   path:    path of the image
+ *              o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int convert_watched(char *path, struct options *o)
+{
+    char name[64], *base, *file;
+    int i, ok;
+    
+    if (! o->watch_dir) return convert(o);
+    
+    file = output_path(path, o);
+    
+    if (file == NULL) {
+        printf("Memory allocation failed (21)");
+        return 0;
+    }
+    
+    base = base_name(path);
+    i = 0;
+    
+    if (isdigit((unsigned char)*base)) name[i++] = '_';
+    
+    for (; *base != '.' && *base != '\0' && i < (int)sizeof(name) - 1; base++) {
+        name[i++] = isalnum((unsigned char)*base) ? *base : '_';
+    }
+    
+    name[i] = '\0';
+    
+    o->input_file = path;
+    o->outputs[0].file = file;
+    o->outputs[0].arrayname = name;
+    ok = convert(o);
+    
+    free(file);
+    
+    return ok;
+}
+
+/* Check a watched image for changes. A changed image is converted when
+ * it stays the same for one poll, so a burst of writes gives one
+ * conversion. At the start an image in a watched directory is only
+ * converted if its output is missing or older.
+ * 
+ * Arguments:   path:    path of the image
+ *              files:   pointer to the list of watched images
+ *              n:       pointer to the number of watched images
+ *              first:   nonzero at the first poll
+ *              o:       pointer to options structure
+ * 
+ * Return:      nothing
+ */
+void watch_file(char *path, struct watched **files, int *n, int first, struct options *o)
+{
+    struct stat st, out_st;
+    struct watched *w = NULL, *grown;
+    char *file;
+    int i;
+    
+    if (stat(path, &st) != 0) return;
+    
+    for (i = 0; i < *n && w == NULL; i++) {
+        if (strcmp((*files)[i].path, path) == 0) w = &(*files)[i];
+    }
+    
+    if (w == NULL) {
+        grown = realloc(*files, (*n + 1) * sizeof(struct watched));
+        if (grown == NULL) return;
+        
+        *files = grown;
+        w = &grown[*n];
+        w->path = malloc(strlen(path) + 1);
+        if (w->path == NULL) return;
+        
+        strcpy(w->path, path);
+        w->size = -1;
+        w->mtime = 0;
+        w->pending = 0;
+        (*n)++;
+        
+        file = (first && o->watch_dir) ? output_path(path, o) : NULL;
+        
+        if (file != NULL && stat(file, &out_st) == 0 && out_st.st_mtime >= st.st_mtime) {
+            w->size = (long)st.st_size;
+            w->mtime = st.st_mtime;
+        }
+        
+        free(file);
+    }
+    
+    if ((long)st.st_size != w->size || st.st_mtime != w->mtime) {
+        w->size = (long)st.st_size;
+        w->mtime = st.st_mtime;
+        w->pending = 1;
+    } else if (w->pending) {
+        w->pending = 0;
+        printf(convert_watched(path, o) ? "Converted %s\n" : "Failed to convert %s\n", path);
+        fflush(stdout);
+    }
+}
+
+/* Check all BMP images in a directory tree for changes
+ * 
+ * Arguments:   dir:     path of the directory
+ *              files:   pointer to the list of watched images
+ *              n:       pointer to the number of watched images
+ *              first:   nonzero at the first poll
+ *              o:       pointer to options structure
+ * 
+ * Return:      nothing
+ */
+void watch_tree(char *dir, struct watched **files, int *n, int first, struct options *o)
+{
+    struct stat st;
+    char **names, *path, *ext;
+    int i, count = 0;
+    
+    names = list_dir(dir, &count);
+    if (names == NULL) return;
+    
+    for (i = 0; i < count; i++) {
+        path = malloc(strlen(dir) + strlen(names[i]) + 2);
+        
+        if (path != NULL) {
+            sprintf(path, "%s/%s", dir, names[i]);
+            ext = strrchr(names[i], '.');
+            
+            if (stat(path, &st) != 0) {
+                /* vanished or unreadable, skip it */
+            } else if (S_ISDIR(st.st_mode)) {
+                watch_tree(path, files, n, first, o);
+            } else if (ext != NULL && strlen(ext) == 4 && tolower((unsigned char)ext[1]) == 'b'
+                       && tolower((unsigned char)ext[2]) == 'm' && tolower((unsigned char)ext[3]) == 'p') {
+                watch_file(path, files, n, first, o);
+            }
+            
+            free(path);
+        }
+        
+        free(names[i]);
+    }
+    
+    free(names);
+}
+
+/* Watch the input image, or all images in a directory tree, and
+ * convert them again with the same options when they change (-watch).
+ * The files are polled every WATCH_INTERVAL seconds with stat(), which
+ * works on every system and for directories on network shares.
+ * This does not return, stop it with Ctrl-C.
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int watch(struct options *o)
+{
+    struct watched *files = NULL;
+    int n = 0, first = 1;
+    
+    printf("Watching %s, stop with Ctrl-C\n", o->watch);
+    fflush(stdout);
+    
+    for (;;) {
+        if (o->watch_dir) {
+            watch_tree(o->watch, &files, &n, first, o);
+        } else {
+            watch_file(o->watch, &files, &n, first, o);
+        }
+        
+        first = 0;
+        sleep(WATCH_INTERVAL);
+    }
+    
+    return 1;
+}
+
+/* Gather the statistics of an image for -auto in one pass over the
+ * pixels: a histogram of every channel, the number of different colors
+ * and the number of runs of equal pixels. The quantization error of any
+ * pixel format follows from the histograms (see quantize_error()), so
+ * no format has to be tried on the image itself.
+ * 
+ * Arguments:   buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              a:       pointer to analysis structure to save it in
+ * 
+ * Return:      0 if failed
+ */
+int analyze_image(struct pixel *buf, struct bmp_header *h, struct analysis *a)
+{
+    unsigned char *seen;
+    unsigned long i, c;
+    struct pixel *p;
+    
+    memset(a, 0, sizeof(*a));
+    a->pixels = (unsigned long)h->width * h->height;
+    
+    /* one bit for every 24 bit color */
+    seen = calloc(1 << 21, 1);
+    
+    if (seen == NULL) {
+        printf("Memory allocation failed (17)");
+        return 0;
+    }
+    
+    for (i = 0, p = buf; i < a->pixels; i++, p++) {
+        a->hist[LUT_r][p->r]++;
+        a->hist[LUT_g][p->g]++;
+        a->hist[LUT_b][p->b]++;
+        a->hist[LUT_a][p->a]++;
+        
+        c = ((unsigned long)p->r << 16) | (p->g << 8) | p->b;
+        
+        if (! (seen[c >> 3] & (1 << (c & 7)))) {
+            seen[c >> 3] |= 1 << (c & 7);
+            a->colors++;
+        }
+        
+        if (i % h->width == 0 || memcmp(p, p - 1, sizeof(*p)) != 0) a->runs++;
+    }
+    
+    a->alpha = a->hist[LUT_a][255] != a->pixels;
+    free(seen);
+    
+    return 1;
+}
+
+/* Mean squared error of an image in a pixel format, from the channel
+ * histograms. A channel of b bits is expanded back to 8 bits as a
+ * display would (v * 255 / (2^b - 1)). A format without alpha shows
+ * every pixel opaque, which is only an error if the image has alpha.
+ * 
+ * Arguments:   a:         pointer to analysis structure
+ *              f:         pointer to pixel format
+ *              round:     nonzero if channels are rounded (-round)
+ *              max_error: pointer to save the largest channel error in
+ * 
+ * Return:      mean squared error per channel
+ */
+double quantize_error(struct analysis *a, struct pixfmt *f, int round, int *max_error)
+{
+    static const char channels[] = "rgba";
+    double sse = 0;
+    char *c;
+    int ch, v, bits, max, q, e;
+    
+    *max_error = 0;
+    
+    for (ch = 0; ch < (a->alpha ? 4 : 3); ch++) {
+        c = strchr(f->order, channels[ch]);
+        bits = (c != NULL) ? f->bits[c - f->order] : 0;
+        max = (1 << bits) - 1;
+        
+        for (v = 0; v < 256; v++) {
+            if (a->hist[ch][v] == 0) continue;
+            
+            if (bits == 0) {
+                e = 255 - v;
+            } else {
+                q = round ? (v * max + 127) / 255 : v >> (8 - bits);
+                e = v - (q * 255 + max / 2) / max;
+            }
+            
+            if (e < 0) e = -e;
+            if (e > *max_error) *max_error = e;
+            sse += (double)e * e * a->hist[ch][v];
+        }
+    }
+    
+    return sse / ((double)a->pixels * (a->alpha ? 4 : 3));
+}
+
+/* Choose the pixel format of all outputs from the image (-auto): the
+ * smallest format that keeps the PSNR or the largest channel error
+ * within the limit, or the most accurate format that fits in a number
+ * of bytes. The candidates and the decision are printed.
+ * 
+ * Arguments:   buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              o:       pointer to options structure
+ * 
+ * Return:      0 if failed
+ */
+int auto_pixfmt(struct pixel *buf, struct bmp_header *h, struct options *o)
+{
+    struct analysis a;
+    struct pixfmt *f, *best = NULL;
+    double mse[NUM_PIXFMTS];
+    int max_error[NUM_PIXFMTS];
+    unsigned long size[NUM_PIXFMTS];
+    int i, b = -1, fits, bits;
+    
+    if (! analyze_image(buf, h, &a)) return 0;
+    
+    printf("Auto: %lu pixels, %lu colors%s, %lu runs of equal pixels (%.1f pixels per run)\n",
+           a.pixels, a.colors, a.alpha ? " with alpha" : "", a.runs, (double)a.pixels / a.runs);
+    
+    /* an indexed image, for comparison, there is no palette format */
+    if (a.colors <= 256) {
+        for (bits = 1; (1UL << bits) < a.colors; bits++);
+        printf("Auto: a %d bit palette would take %lu bytes\n",
+               bits, a.colors * 3 + (a.pixels * bits + 7) / 8);
+    }
+    
+    printf("%-10s %9s %9s %9s\n", "format", "bytes", "PSNR dB", "max error");
+    
+    for (i = 0; i < NUM_PIXFMTS; i++) {
+        f = &pixfmts[i];
+        if (f->pack == NULL || strchr(f->order, 'r') == NULL) continue;
+        
+        mse[i] = quantize_error(&a, f, o->round, &max_error[i]);
+        size[i] = packed_size(f, a.pixels);
+        
+        if (mse[i] == 0) {
+            printf("%-10s %9lu %9s %9d\n", f->name, size[i], "lossless", max_error[i]);
+        } else {
+            printf("%-10s %9lu %9.2f %9d\n", f->name, size[i],
+                   10 * log10(255.0 * 255.0 / mse[i]), max_error[i]);
+        }
+        
+        if (o->auto_mode == AUTO_PSNR) {
+            fits = mse[i] == 0 || 10 * log10(255.0 * 255.0 / mse[i]) >= o->auto_limit;
+        } else if (o->auto_mode == AUTO_MAXERROR) {
+            fits = max_error[i] <= o->auto_limit;
+        } else {
+            fits = size[i] <= o->auto_limit;
+        }
+        
+        /* quality limit: smallest first, byte budget: most accurate first */
+        if (fits && (best == NULL
+            || (o->auto_mode != AUTO_BYTES && (size[i] < size[b] || (size[i] == size[b] && mse[i] < mse[b])))
+            || (o->auto_mode == AUTO_BYTES && (mse[i] < mse[b] || (mse[i] == mse[b] && size[i] < size[b]))))) {
+            best = f;
+            b = i;
+        }
+    }
+    
+    if (best == NULL) {
+        /* nothing fits: the most accurate or the smallest format */
+        for (i = 0; i < NUM_PIXFMTS; i++) {
+            if (pixfmts[i].pack == NULL || strchr(pixfmts[i].order, 'r') == NULL) continue;
+            
+            if (b < 0 || (o->auto_mode != AUTO_BYTES && mse[i] < mse[b])
+                || (o->auto_mode == AUTO_BYTES && size[i] < size[b])) {
+                b = i;
+            }
+        }
+        
+        best = &pixfmts[b];
+        printf("Auto: no pixel format is within the limit, using the %s one\n",
+               (o->auto_mode == AUTO_BYTES) ? "smallest" : "most accurate");
+    }
+    
+    printf("Auto: using %s, %lu bytes\n", best->name, size[b]);
+    
+    for (i = 0; i < o->num_outputs; i++) {
+        o->outputs[i].pixfmt = best;
+    }
+    
+    return 1;
+}
+
+/* Get the packed bytes of a C array written by bmpdump, with the image
+ * size, pixel format and stride from its comment. The bytes of all banks
+ * are taken, up to the next image in the file (-append).
+ * 
+ * Arguments:   text:    contents of the C file, zero terminated
+ *              len:     pointer to save the number of bytes in
+ *              h:       pointer to bmp_header structure to save the size in
+ *              f:       pointer to save the pixel format in
+ *              stride:  pointer to save the stride in, 0 if rows are not padded
+ * 
+ * Return:      pointer to the bytes or NULL if it is not an image array
+ */
+unsigned char *parse_carray(char *text, long *len, struct bmp_header *h, struct pixfmt **f, int *stride)
+{
+    char *p, *end, *q;
+    unsigned char *data;
+    int i;
+    
+    p = strstr(text, "containing data of a ");
+    end = (p != NULL) ? strstr(p, " */") : NULL;
+    
+    if (end == NULL || sscanf(p + 21, "%ux%u", &h->width, &h->height) != 2) {
+        printf("This is not a C array of an image written by bmpdump\n");
+        return NULL;
+    }
+    
+    *end = '\0';
+    
+    if (strstr(p, " tiles of ") != NULL) {
+        printf("Tiled images can not be unpacked\n");
+        return NULL;
+    }
+    
+    *f = NULL;
+    q = strstr(p, "Each pixel has ");
+    
+    for (i = 0; q != NULL && i < NUM_PIXFMTS; i++) {
+        if (strncmp(q + 15, pixfmts[i].layout, strlen(pixfmts[i].layout)) == 0
+            && q[15 + strlen(pixfmts[i].layout)] == '.') *f = &pixfmts[i];
+    }
+    
+    if (*f == NULL) {
+        printf("Unknown pixel format in the C array comment\n");
+        return NULL;
+    }
+    
+    *stride = 0;
+    q = strstr(p, "takes ");
+    if (q != NULL) sscanf(q, "takes %d bytes (stride)", stride);
+    
+    /* the bytes start at the first array, up to the next image */
+    p = strchr(end + 1, '{');
+    if (p == NULL) p = end + 1;
+    q = strstr(p, "/* Array with bitmap");
+    if (q != NULL) *q = '\0';
+    
+    data = malloc(strlen(p) / 5 + 1);
+    
+    if (data == NULL) {
+        printf("Memory allocation failed (22)");
+        return NULL;
+    }
+    
+    for (*len = 0; (p = strstr(p, "0x")) != NULL; ) {
+        if (isalnum((unsigned char)p[-1]) || p[-1] == '_') {
+            p += 2;
+            continue;
+        }
+        data[(*len)++] = (unsigned char)strtoul(p, &p, 16);
+    }
+    
+    return data;
+}
+
+/* Offset of a row in packed data with padded rows, or in banks
+ * of bank_size bytes (raw files with -banksize).
+ * 
+ * Arguments:   y:         row
+ *              stride:    bytes per row
+ *              bank_rows: rows per bank, 0 if not split in banks
+ *              bank_size: bytes per bank
+ * 
+ * Return:      offset of the row
+ */
+long row_offset(unsigned int y, int stride, int bank_rows, long bank_size)
+{
+    if (bank_rows > 0) return (y / bank_rows) * bank_size + (long)(y % bank_rows) * stride;
+    
+    return (long)y * stride;
+}
+
+/* Unpack an image of any pixel format into a newly allocated pixel
+ * buffer, in the row order of the outputs (bottom line first).
+ * 
+ * Arguments:   data:      packed bytes
+ *              len:       number of packed bytes
+ *              f:         pointer to the pixel format
+ *              h:         pointer to bmp_header structure with the size
+ *              stride:    bytes per row, 0 if rows are not padded
+ *              bank_rows: rows per bank, 0 if not split in banks
+ *              bank_size: bytes per bank
+ * 
+ * Return:      pointer to the pixel buffer or NULL if failed
+ */
+struct pixel *unpack_image(unsigned char *data, long len, struct pixfmt *f, struct bmp_header *h,
+                           int stride, int bank_rows, long bank_size)
+{
+    struct pixel *buf, *pix;
+    long need, i, c, pixels = (long)h->width * h->height;
+    unsigned int x, y, cw = (h->width + 1) / 2, chh = (h->height + 1) / 2;
+    unsigned char *chroma = data + pixels;
+    
+    if (stride == 0 && f->pack != NULL && row_aligned(f)) stride = packed_size(f, h->width);
+    
+    if (stride > 0) {
+        need = row_offset(h->height - 1, stride, bank_rows, bank_size) + packed_size(f, h->width);
+    } else {
+        need = image_size(f, h->width, h->height);
+    }
+    
+    if (len < need) {
+        printf("%ld bytes, a %ux%u %s image needs %ld\n", len, h->width, h->height, f->name, need);
+        return NULL;
+    }
+    
+    buf = malloc(pixels * sizeof(struct pixel));
+    
+    if (buf == NULL) {
+        printf("Memory allocation failed (23)");
+        return NULL;
+    }
+    
+    if (f->packing == PACKING_PAGED) {
+        for (y = 0; y < h->height; y++) {
+            pix = buf + (h->height - 1 - y) * h->width;
+            
+            for (x = 0; x < h->width; x++, pix++) {
+                pix->r = pix->g = pix->b = ((data[(y / 8) * h->width + x] >> (y % 8)) & 1) ? 255 : 0;
+                pix->a = 255;
+            }
+        }
+    } else if (f->pack == NULL) {
+        /* every chroma sample covers 2x2 pixels */
+        for (i = 0, y = 0; y < h->height; y++) {
+            for (x = 0; x < h->width; x++, i++) {
+                c = (y / 2) * cw + x / 2;
+                
+                if (f->packing == PACKING_PLANAR) {
+                    yuv_to_rgb(data[i], chroma[c], chroma[cw * chh + c], buf + i);
+                } else {
+                    yuv_to_rgb(data[i], chroma[2*c], chroma[2*c + 1], buf + i);
+                }
+            }
+        }
+    } else if (stride > 0) {
+        for (y = 0; y < h->height; y++) {
+            f->unpack(data + row_offset(y, stride, bank_rows, bank_size), h->width, buf + y * h->width);
+        }
+    } else {
+        f->unpack(data, pixels, buf);
+    }
+    
+    return buf;
+}
+
+/* Compare packed bytes with the bytes of the reference packing code
+ * for the original image, see ref_pack().
+ * 
+ * Arguments:   data:      packed bytes
+ *              orig:      pointer to the pixels of the original image
+ *              f:         pointer to the pixel format
+ *              h:         pointer to bmp_header structure with the size
+ *              stride:    bytes per row, 0 if rows are not padded
+ *              bank_rows: rows per bank, 0 if not split in banks
+ *              bank_size: bytes per bank
+ *              o:         pointer to options structure (1 bit threshold)
+ * 
+ * Return:      offset of the first different byte, -1 if all are
+ *              equal or -2 if failed
+ */
+long compare_packed(unsigned char *data, struct pixel *orig, struct pixfmt *f, struct bmp_header *h,
+                    int stride, int bank_rows, long bank_size, struct options *o)
+{
+    struct bmp_header row = *h;
+    unsigned char *ref;
+    long i, n, offset, diff = -1;
+    unsigned int y;
+    
+    ref = malloc((long)h->width * h->height * 4 + 4);
+    
+    if (ref == NULL) {
+        printf("Memory allocation failed (24)");
+        return -2;
+    }
+    
+    if (stride == 0 && f->pack != NULL && row_aligned(f)) stride = packed_size(f, h->width);
+    
+    if (stride == 0) {
+        n = ref_pack(f, orig, h, ref, o);
+        
+        for (i = 0; i < n && diff < 0; i++) {
+            if (data[i] != ref[i]) diff = i;
+        }
+    } else {
+        row.height = 1;
+        
+        for (y = 0; y < h->height && diff < 0; y++) {
+            n = ref_pack(f, orig + y * h->width, &row, ref, o);
+            offset = row_offset(y, stride, bank_rows, bank_size);
+            
+            for (i = 0; i < n && diff < 0; i++) {
+                if (data[offset + i] != ref[i]) diff = offset + i;
+            }
+        }
+    }
+    
+    free(ref);
+    
+    return diff;
+}
+
+/* Unpack a raw or C array output and write it as a preview BMP.
+ * With -if the channel errors against the original image are reported
+ * and, for a conversion without -gamma, -lut, -round or -dither, the
+ * bytes are compared with a conversion of the original, so a build can
+ * find outdated or damaged assets.
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if failed or the bytes differ from the conversion
+ */
+int unpack(struct options *o)
+{
+    struct bmp_header h, orig_h;
+    struct pixfmt *f = NULL;
+    struct pixel *buf = NULL, *orig = NULL, lum;
+    unsigned char *data, *text, *a, *b;
+    char *preview = o->output_file;
+    long len, i, differ = 0, pixels, diff;
+    int stride = 0, bank_rows = 0, channels, c, err, max_error = 0, ok = 0;
+    double mse = 0;
+    
+    if (o->input_file != NULL) {
+        orig = read_bmp(o->input_file, &orig_h);
+        if (orig == NULL) return 0;
+    }
+    
+    text = read_file(o->unpack, &len);
+    
+    if (text == NULL) {
+        printf("Failed to open file %s\n", o->unpack);
+        free(orig);
+        return 0;
+    }
+    
+    /* a C array starts with the bmpdump comment, anything else is raw */
+    if (len >= 2 && text[0] == '/' && text[1] == '*') {
+        text[len] = '\0';
+        data = parse_carray((char *)text, &len, &h, &f, &stride);
+        free(text);
+    } else {
+        data = text;
+        
+        if (o->pixfmt != NULL || o->bpp != UNSET) f = default_pixfmt(o);
+        
+        h.width = (o->unpack_width > 0) ? o->unpack_width : (orig != NULL) ? orig_h.width : 0;
+        h.height = (o->unpack_width > 0) ? o->unpack_height : (orig != NULL) ? orig_h.height : 0;
+        
+        if (f == NULL || h.width == 0) {
+            printf("A raw file needs its pixel format (-pixfmt or -bpp) and size (-size or -if)\n");
+            free(data);
+            data = NULL;
+        } else if ((o->stride > 0 || o->bank_size > 0) && f->pack != NULL) {
+            stride = packed_size(f, h.width);
+            if (o->stride > 0) stride = (stride + o->stride - 1) / o->stride * o->stride;
+            if (o->bank_size > 0) bank_rows = o->bank_size / stride;
+        }
+    }
+    
+    if (data != NULL) buf = unpack_image(data, len, f, &h, stride, bank_rows, o->bank_size);
+    
+    if (buf != NULL && preview == NULL) {
+        preview = malloc(strlen(o->unpack) + 5);
+        if (preview != NULL) sprintf(preview, "%s.bmp", o->unpack);
+    }
+    
+    if (buf != NULL && preview != NULL) {
+        ok = write_bmp(preview, buf, h.width, h.height, (strchr(f->order, 'a') != NULL) ? 32 : 24);
+        printf("%s: %ux%u %s, preview %s\n", o->unpack, h.width, h.height, f->name, preview);
+    }
+    
+    if (ok && orig != NULL && (orig_h.width != h.width || orig_h.height != h.height)) {
+        printf("%s: the original is %ux%u\n", o->unpack, orig_h.width, orig_h.height);
+        ok = 0;
+    } else if (ok && orig != NULL) {
+        /* errors of the red, green and blue channels, and alpha if kept,
+         * gray and 1 bit formats against the luminance of the original
+         */
+        pixels = (long)h.width * h.height;
+        channels = (strchr(f->order, 'a') != NULL) ? 4 : 3;
+        
+        for (i = 0; i < pixels; i++) {
+            a = &buf[i].r;
+            b = &orig[i].r;
+            
+            if (f->packing == PACKING_GRAY || f->packing == PACKING_PAGED) {
+                lum.r = lum.g = lum.b = (77 * orig[i].r + 150 * orig[i].g + 29 * orig[i].b) >> 8;
+                b = &lum.r;
+            }
+            
+            for (c = 0; c < channels; c++) {
+                err = abs(a[c] - b[c]);
+                mse += err * err;
+                if (err > max_error) max_error = err;
+            }
+            
+            differ += memcmp(a, b, channels) != 0;
+        }
+        
+        mse /= (double)pixels * channels;
+        printf("%s: max error %d, ", o->unpack, max_error);
+        
+        if (mse > 0) {
+            printf("PSNR %.2f dB, ", 10 * log10(255.0 * 255.0 / mse));
+        } else {
+            printf("PSNR inf, ");
+        }
+        
+        printf("%ld of %ld pixels differ\n", differ, pixels);
+        
+        if (o->gamma[0] == 0 && o->lut_file == NULL && ! o->round && ! o->dither) {
+            diff = compare_packed(data, orig, f, &h, stride, bank_rows, o->bank_size, o);
+            
+            if (diff == -1) {
+                printf("%s: the bytes match a conversion of %s\n", o->unpack, o->input_file);
+            } else if (diff >= 0) {
+                printf("%s: byte %ld differs from a conversion of %s\n", o->unpack, diff, o->input_file);
+            }
+            
+            ok = diff == -1;
+        }
+    }
+    
+    if (preview != o->output_file) free(preview);
+    free(buf);
+    free(data);
+    free(orig);
+    
+    return ok;
+}
+
+/* Write a pixel buffer as a 24 bit (BGR) or 32 bit (BGRA)
+ * uncompressed BMP image.
+ * 
+ * Arguments:   file:    path of the BMP image
+ *              buf:     pointer to array of pixel structures
+ *              w:       image width
+ *              h:       image height
+ *              bpp:     24 or 32
+ * 
+ * Return:      0 if failed to create the file
+ */
+int write_bmp(char *file, struct pixel *buf, unsigned int w, unsigned int h, int bpp)
+{
+    FILE *fp;
+    unsigned int line, col, padding, data_size, bytes = bpp / 8;
+    unsigned char *row;
+    struct pixel *pix = buf;
+    
+    padding = (4 - (w * bytes) % 4) % 4;
+    data_size = (w * bytes + padding) * h;
+    
+    row = calloc(w * bytes + padding, 1);
+    fp = fopen(file, "wb");
+    
+    if (row == NULL || fp == NULL) {
+        printf("Failed open output file %s\n", file);
+        free(row);
+        if (fp != NULL) fclose(fp);
+        return 0;
+    }
+    
+    fwrite("BM", 1, 2, fp);
+    put_u32(fp, 54 + data_size);
+    put_u32(fp, 0);
+    put_u32(fp, 54);
+    put_u32(fp, 40);
+    put_u32(fp, w);
+    put_u32(fp, h);
+    put_u16(fp, 1);
+    put_u16(fp, bpp);
+    put_u32(fp, 0);
+    put_u32(fp, data_size);
+    put_u32(fp, 2835);
+    put_u32(fp, 2835);
+    put_u32(fp, 0);
+    put_u32(fp, 0);
+    
+    for (line = 0; line < h; line++) {
+        for (col = 0; col < w; col++, pix++) {
+            row[col*bytes] = pix->b;
+            row[col*bytes+1] = pix->g;
+            row[col*bytes+2] = pix->r;
+            if (bytes == 4) row[col*4+3] = pix->a;
+        }
+        fwrite(row, 1, w * bytes + padding, fp);
+    }
+    
+    free(row);
+    
+    return fclose(fp) == 0;
+}
+
+/* Read a whole file into a newly allocated buffer.
+ * 
+ * Arguments:   file:    path of the file
+ *              len:     pointer to save the file length in
+ * 
+ * Return:      pointer to the buffer or NULL if reading failed
+ */
+unsigned char *read_file(char *file, long *len)
+{
+    FILE *fp;
+    unsigned char *data;
+    
+    fp = fopen(file, "rb");
+    if (fp == NULL) return NULL;
+    
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    data = malloc(*len + 1);
+    
+    if (data != NULL && fread(data, 1, *len, fp) != (size_t)*len) {
+        free(data);
+        data = NULL;
+    }
+    
+    fclose(fp);
+    
+    return data;
+}
+
+/* Write one reference byte, as C array text or raw.
+ * 
+ * Arguments:   fp:      pointer to file descriptor
+ *              carray:  nonzero for C array output
+ *              b:       byte to write
+ * 
+ * Return:      nothing
+ */
+void ref_put(FILE *fp, int carray, unsigned char b)
+{
+    if (carray) {
+        fprintf(fp, "0x%.2x, ", b);
+    } else {
+        fwrite(&b, sizeof(unsigned char), 1, fp);
+    }
+}
+
+/* Reference output of the original create_c_array_* and create_raw_*
+ * functions (8, 12, 16 and 24 bits). The pixel loops are frozen copies
+ * of the original scalar code and are only used by the selftest, do
+ * not optimize them.
+ * 
+ * Arguments:   fp:      pointer to file descriptor
+ *              carray:  nonzero for C array output
+ *              bpp:     bits per pixel
+ *              buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              name:    C array name
+ * 
+ * Return:      nothing
+ */
+void ref_create(FILE *fp, int carray, int bpp, struct pixel *buf, struct bmp_header *h, char *name)
+{
+    int i, pixels = h->width * h->height;
+    unsigned char b, b1, b2, b3;
+    struct pixel *pix = buf;
+    
+    if (carray) {
+        fprintf(fp, "/* This is an auto-generated file generated by bmpdump */\n\n");
+        fprintf(fp, "/* Array with bitmap containing data of a %ux%u (%u pixels) image.\n", h->width, h->height, pixels);
+        
+        if (bpp == 8) fprintf(fp, " * Each pixel has 8 bits (RRRGGGBB).\n");
+        if (bpp == 12) fprintf(fp, " * Each pixel has 12 bits, two pixels share three bytes (RRRRGGGG BBBBRRRR GGGGBBBB).\n");
+        if (bpp == 16) fprintf(fp, " * Each pixel has 16 bits (RRRRRGGG GGGBBBBB).\n");
+        if (bpp == 24) fprintf(fp, " * Each pixel has 24 bits (RRRRRRRR GGGGGGGG BBBBBBBB).\n");
+        
+        fprintf(fp, " */\n");
+        fprintf(fp, "unsigned char %s[] = {\n\t", name);
+    }
+    
+    if (bpp == 8) {
+        for (i=0; i< pixels; i++) {
+            b = pix->r;
+            b &= ~(0xFF >> 3);
+            b |= (pix->g >> 3);
+            b &= ~(0xFF >> 6);
+            b |= (pix->b >> 6);
+            ref_put(fp, carray, b);
+            pix++;
+            if (carray && ((i+1) % 12) == 0) fprintf(fp, "\n\t");
+        }
+    } else if (bpp == 12) {
+        for (i=0; i< pixels; i+=2) {
+            b1 = pix->r;
+            b1 &= ~0x0F;
+            b1 |= (pix->g >> 4);
+            b2 = pix->b;
+            b2 &= ~0x0F;
+            ref_put(fp, carray, b1);
+            
+            if ((i+2) <= pixels) {
+                pix++;
+                b2 |= (pix->r >> 4);
+                b3 = pix->g;
+                b3 &= ~0x0F;
+                b3 |= (pix->b >> 4);
+                ref_put(fp, carray, b2);
+                ref_put(fp, carray, b3);
+            } else {
+                ref_put(fp, carray, b2);
+            }
+            
+            pix++;
+            if (carray && ((i+2) % 8) == 0) fprintf(fp, "\n\t");
+        }
+    } else if (bpp == 16) {
+        for (i=0; i< pixels; i++) {
+            b1 = pix->r;
+            b1 &= ~(0xFF >> 5);
+            b1 |= (pix->g >> 5);
+            b2 = (pix->g << 3);
+            b2 &= ~(0xFF >> 3);
+            b2 |= (pix->b >> 3);
+            ref_put(fp, carray, b1);
+            ref_put(fp, carray, b2);
+            pix++;
+            if (carray && ((i+1) % 6) == 0) fprintf(fp, "\n\t");
+        }
+    } else if (bpp == 24) {
+        for (i=0; i< pixels; i++) {
+            ref_put(fp, carray, pix->r);
+            ref_put(fp, carray, pix->g);
+            ref_put(fp, carray, pix->b);
             pix++;
-            b2 |= (pix->r >> 4);
+            if (carray && ((i+1) % 4) == 0) fprintf(fp, "\n\t");
+        }
+    }
+    
+    if (carray) fprintf(fp, "\n};");
+}
+
+/* Reference packing of any pixel format, one pixel at a time
+ * straight from the descriptor. Only used by the selftest.
+ * 
+ * Arguments:   f:       pointer to pixel format
+ *              buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              dst:     pointer to destination buffer
+ *              o:       pointer to options structure (1 bit threshold)
+ * 
+ * Return:      number of bytes written to dst
+ */
+long ref_pack(struct pixfmt *f, struct pixel *buf, struct bmp_header *h, unsigned char *dst, struct options *o)
+{
+    unsigned long v, lum;
+    unsigned int x, y, c, shift, cw, chh;
+    long n = 0, i, pixels = h->width * h->height;
+    unsigned int channels = strlen(f->order);
+    int sum[3];
+    unsigned char ch[4];
+    struct pixel *pix, pair[2];
+    
+    if (f->packing == PACKING_PAGED) {
+        for (y = 0; y < h->height; y += 8) {
+            for (x = 0; x < h->width; x++) {
+                dst[n] = 0;
+                for (c = 0; c < 8 && y + c < h->height; c++) {
+                    pix = buf + (h->height - 1 - y - c) * h->width + x;
+                    lum = (77 * pix->r + 150 * pix->g + 29 * pix->b) >> 8;
+                    if (lum >= (unsigned long)o->threshold) dst[n] |= 1 << c;
+                }
+                n++;
+            }
+        }
+        return n;
+    }
+    
+    if (f->packing == PACKING_GRAY) {
+        for (i = 0; i < pixels; i++) {
+            /* every row starts at a byte */
+            c = (i % h->width) % f->unit_pixels;
+            lum = (77 * buf[i].r + 150 * buf[i].g + 29 * buf[i].b) >> (16 - f->bits[0]);
+            shift = (f->endian == ENDIAN_BIG) ? 8 - f->bits[0] * (c + 1) : f->bits[0] * c;
+            
+            if (c == 0) dst[n++] = 0;
+            dst[n-1] |= lum << shift;
+        }
+        return n;
+    }
+    
+    if (f->packing == PACKING_PLANAR || f->packing == PACKING_SEMIPLANAR) {
+        for (i = 0; i < pixels; i++) {
+            dst[n++] = YUV_Y(buf[i].r, buf[i].g, buf[i].b);
+        }
+        
+        cw = (h->width + 1) / 2;
+        chh = (h->height + 1) / 2;
+        
+        for (y = 0; y < chh; y++) {
+            for (x = 0; x < cw; x++) {
+                sum[0] = sum[1] = sum[2] = 0;
+                
+                for (c = 0; c < 4; c++) {
+                    pix = buf + ((2*y + c/2 < h->height) ? 2*y + c/2 : h->height - 1) * h->width
+                              + ((2*x + c%2 < h->width) ? 2*x + c%2 : h->width - 1);
+                    sum[0] += pix->r;
+                    sum[1] += pix->g;
+                    sum[2] += pix->b;
+                }
+                
+                i = (f->packing == PACKING_PLANAR) ? y * cw + x : 2 * (y * cw + x);
+                dst[n + i] = YUV_U(sum[0], sum[1], sum[2], 2);
+                i += (f->packing == PACKING_PLANAR) ? cw * chh : 1;
+                dst[n + i] = YUV_V(sum[0], sum[1], sum[2], 2);
+            }
+        }
+        
+        return n + 2 * cw * chh;
+    }
+    
+    if (f->packing == PACKING_YUV422) {
+        for (y = 0; y < h->height; y++) {
+            for (x = 0; x < h->width; x += 2) {
+                pix = buf + y * h->width + x;
+                
+                /* a last single pixel of a row is repeated */
+                pair[0] = pix[0];
+                pair[1] = (x + 1 < h->width) ? pix[1] : pix[0];
+                sum[0] = pair[0].r + pair[1].r;
+                sum[1] = pair[0].g + pair[1].g;
+                sum[2] = pair[0].b + pair[1].b;
+                
+                for (c = 0, shift = 0; c < 4; c++) {
+                    if (f->order[c] == 'y') {
+                        dst[n++] = YUV_Y(pair[shift].r, pair[shift].g, pair[shift].b);
+                        shift++;
+                    } else if (f->order[c] == 'u') {
+                        dst[n++] = YUV_U(sum[0], sum[1], sum[2], 1);
+                    } else {
+                        dst[n++] = YUV_V(sum[0], sum[1], sum[2], 1);
+                    }
+                }
+            }
+        }
+        
+        return n;
+    }
+    
+    for (i = 0; i < pixels; i++) {
+        pix = buf + i;
+        
+        for (c = 0; c < channels; c++) {
+            ch[c] = (f->order[c] == 'r') ? pix->r : (f->order[c] == 'g') ? pix->g
+                  : (f->order[c] == 'b') ? pix->b : pix->a;
+        }
+        
+        if (f->packing == PACKING_CHANNEL) {
+            for (c = 0; c < channels; c++) {
+                dst[n++] = ch[c] & (0xFF << (8 - f->bits[c]));
+            }
+        } else if (f->packing == PACKING_WORD) {
+            v = 0;
+            for (c = 0; c < channels; c++) {
+                v = (v << f->bits[c]) | (ch[c] >> (8 - f->bits[c]));
+            }
+            for (c = 0; c < (unsigned int)f->unit_bytes; c++) {
+                shift = (f->endian == ENDIAN_BIG) ? 8 * (f->unit_bytes - 1 - c) : 8 * c;
+                dst[n++] = (v >> shift) & 0xFF;
+            }
+        } else {
+            /* two pixels in three bytes, nibbles in channel order */
+            if ((i % 2) == 0) {
+                dst[n++] = (ch[0] & 0xF0) | (ch[1] >> 4);
+                dst[n++] = (ch[2] & 0xF0);
+            } else {
+                dst[n-1] |= ch[0] >> 4;
+                dst[n++] = (ch[1] & 0xF0) | (ch[2] >> 4);
+            }
+        }
+    }
+    
+    return n;
+}
+
+/* Compare a file with the expected bytes.
+ * 
+ * Arguments:   file:    path of the file
+ *              exp:     expected bytes
+ *              len:     number of expected bytes
+ *              what:    description for the error message
+ * 
+ * Return:      1 if equal
+ */
+int selftest_compare(char *file, unsigned char *exp, long len, char *what)
+{
+    unsigned char *data;
+    long n, i;
+    
+    data = read_file(file, &n);
+    
+    if (data == NULL) {
+        printf("FAIL %s: output missing\n", what);
+        return 0;
+    }
+    
+    for (i = 0; i < n && i < len && data[i] == exp[i]; i++);
+    free(data);
+    
+    if (n != len || i != len) {
+        printf("FAIL %s: differs at byte %ld (%ld bytes, expected %ld)\n", what, i, n, len);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/* Measure packing throughput of a pixel format.
+ * 
+ * Arguments:   f:       pointer to pixel format
+ *              buf:     pointer to array of pixel structures
+ *              h:       pointer to bmp_header structure
+ *              dst:     pointer to destination buffer
+ *              ref:     nonzero to measure the reference packing
+ *              o:       pointer to options structure
+ * 
+ * Return:      megapixels per second
+ */
+double selftest_speed(struct pixfmt *f, struct pixel *buf, struct bmp_header *h,
+                      unsigned char *dst, int ref, struct options *o)
+{
+    clock_t start, now;
+    unsigned int line;
+    long runs = 0;
+    
+    start = clock();
+    
+    do {
+        if (ref) {
+            ref_pack(f, buf, h, dst, o);
+        } else {
+            for (line = 0; line < h->height; line++) {
+                f->pack(buf + line * h->width, h->width, dst + line * packed_size(f, h->width));
+            }
+        }
+        runs++;
+        now = clock();
+    } while (now - start < CLOCKS_PER_SEC / 5);
+    
+    return (double)runs * h->width * h->height / 1e6 / ((double)(now - start) / CLOCKS_PER_SEC);
+}
+
+/* Measure the throughput of all packing functions and compare it
+ * with the baseline. See selftest().
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if a format is much slower than its baseline
+ */
+int selftest_throughput(struct options *o)
+{
+    struct bmp_header h;
+    struct pixel *buf;
+    unsigned char *dst;
+    char names[NUM_PIXFMTS][32], name[32];
+    double values[NUM_PIXFMTS], value, fast, slow, base;
+    int f, i, baselines = 0, failed = 0;
+    FILE *fp;
+    
+    memset(&h, 0, sizeof(h));
+    h.width = SELFTEST_WIDTH;
+    h.height = SELFTEST_HEIGHT;
+    
+    buf = malloc(h.width * h.height * sizeof(struct pixel));
+    dst = malloc(h.width * h.height * 4 + 8);
+    
+    if (buf == NULL || dst == NULL) {
+        printf("Memory allocation failed (14)");
+        return 0;
+    }
+    
+    for (i = 0; i < (int)(h.width * h.height); i++) {
+        buf[i].r = rand() & 0xFF;
+        buf[i].g = rand() & 0xFF;
+        buf[i].b = rand() & 0xFF;
+        buf[i].a = rand() & 0xFF;
+    }
+    
+    if (o->baseline != NULL) {
+        fp = fopen(o->baseline, "r");
+        
+        if (fp == NULL) {
+            printf("Failed to open file %s\n", o->baseline);
+            return 0;
+        }
+        
+        while (baselines < NUM_PIXFMTS && fscanf(fp, "%31s %lf", name, &value) == 2) {
+            strcpy(names[baselines], name);
+            values[baselines++] = value;
+        }
+        
+        fclose(fp);
+    }
+    
+    fp = NULL;
+    
+    if (o->save_baseline != NULL) {
+        fp = fopen(o->save_baseline, "w");
+        
+        if (fp == NULL) {
+            printf("Failed open output file %s\n", o->save_baseline);
+            return 0;
+        }
+    }
+    
+    printf("%-10s %12s %12s %12s\n", "format", "Mpixel/s", "reference", "baseline");
+    
+    for (f = 0; f < NUM_PIXFMTS; f++) {
+        if (pixfmts[f].pack == NULL) continue;
+        
+        fast = selftest_speed(&pixfmts[f], buf, &h, dst, 0, o);
+        slow = selftest_speed(&pixfmts[f], buf, &h, dst, 1, o);
+        base = 0;
+        
+        for (i = 0; i < baselines; i++) {
+            if (strcmp(names[i], pixfmts[f].name) == 0) base = values[i];
+        }
+        
+        printf("%-10s %12.1f %12.1f %12.1f", pixfmts[f].name, fast, slow, base);
+        
+        if (fast < base * SELFTEST_SLOWDOWN) {
+            printf("  FAIL: slower than baseline");
+            failed++;
+        }
+        
+        printf("\n");
+        
+        if (fp != NULL) fprintf(fp, "%s %.1f\n", pixfmts[f].name, fast);
+    }
+    
+    if (fp != NULL) fclose(fp);
+    
+    free(buf);
+    free(dst);
+    
+    return failed == 0;
+}
+
+/* Make the path of a scratch file of the selftest in the temporary
+ * directory ($TMPDIR, %TEMP% or /tmp), unique for this process.
+ * 
+ * Arguments:   path:    buffer of FILENAME_MAX characters for the path
+ *              ext:     extension of the file
+ * 
+ * Return:      0 if the path does not fit
+ */
+int selftest_path(char *path, char *ext)
+{
+    char *dir = getenv("TMPDIR");
+    long pid;
+    
+    if (dir == NULL || *dir == '\0') dir = getenv("TEMP");
+    
+#ifdef _WIN32
+    if (dir == NULL || *dir == '\0') dir = ".";
+    pid = (long)GetCurrentProcessId();
+#else
+    if (dir == NULL || *dir == '\0') dir = "/tmp";
+    pid = (long)getpid();
+#endif
+    
+    if (strlen(dir) + strlen(ext) + 40 > FILENAME_MAX) return 0;
+    
+    sprintf(path, "%s/bmpdump_selftest_%ld.%s", dir, pid, ext);
+    
+    return 1;
+}
+
+/* Check the packing functions against the reference implementations
+ * and measure their speed.
+ * 
+ * Every pixel format is written through the normal output code (raw and
+ * C array) for images with odd sizes (1xN, Nx1, odd pixel counts for the
+ * 12 bit tail) and compared byte for byte with the reference. The BMP
+ * reader is checked by writing and reading back the same images, the
+ * unpacking functions by unpacking the C arrays and packing them again.
+ * Throughput is compared with a baseline file of "<format> <Mpixel/s>"
+ * lines, a format slower than SELFTEST_SLOWDOWN times its baseline fails.
+ * The scratch files are written to the temporary directory and removed
+ * when the test ends, also when it fails.
+ * 
+ * Arguments:   o:       pointer to options structure
+ * 
+ * Return:      0 if a test failed
+ */
+int selftest(struct options *o)
+{
+    static const unsigned int sizes[][2] = {
+        { 1, 1 }, { 1, 9 }, { 9, 1 }, { 2, 3 }, { 3, 2 }, { 3, 3 }, { 5, 7 }, { 7, 5 },
+        { 13, 11 }, { 17, 16 }, { 64, 48 }, { 101, 1 }, { 1, 101 }, { 33, 31 }
+    };
+    static char tmp_bmp[FILENAME_MAX], tmp_raw[FILENAME_MAX], tmp_c[FILENAME_MAX], tmp_ref[FILENAME_MAX];
+    char what[64], name[32];
+    struct options t;
+    struct output lo;
+    struct bmp_header h, h2;
+    struct pixel *buf, *back, *cor;
+    struct pixfmt *uf;
+    unsigned char *exp, *ref_c, *repack, *unp;
+    unsigned int s, i;
+    int f, bpp, stride, failed = 0, tests = 0, ok = 1;
+    long exp_len, ref_len;
+    FILE *fp;
+    
+    if (! selftest_path(tmp_bmp, "bmp") || ! selftest_path(tmp_raw, "raw")
+        || ! selftest_path(tmp_c, "c") || ! selftest_path(tmp_ref, "ref")) {
+        printf("The path of the temporary directory is too long\n");
+        return 0;
+    }
+    
+    fp = fopen(tmp_bmp, "wb");
+    
+    if (fp == NULL) {
+        printf("Can not write the scratch files of the selftest (%s)\n", tmp_bmp);
+        return 0;
+    }
+    
+    fclose(fp);
+    
+    srand(1);
+    
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && ok; s++) {
+        memset(&h, 0, sizeof(h));
+        h.width = sizes[s][0];
+        h.height = sizes[s][1];
+        
+        buf = malloc(h.width * h.height * sizeof(struct pixel));
+        cor = malloc(h.width * h.height * sizeof(struct pixel));
+        exp = malloc(h.width * h.height * 4 + 8);
+        repack = malloc(h.width * h.height * 4 + 8);
+        
+        if (buf == NULL || cor == NULL || exp == NULL || repack == NULL) {
+            printf("Memory allocation failed (13)");
+            free(buf);
+            free(cor);
+            free(exp);
+            free(repack);
+            ok = 0;
+            break;
+        }
+        
+        /* random opaque pixels, with black and white at the start */
+        for (i = 0; i < h.width * h.height; i++) {
+            buf[i].r = rand() & 0xFF;
+            buf[i].g = rand() & 0xFF;
+            buf[i].b = rand() & 0xFF;
+            buf[i].a = 0xFF;
+        }
+        
+        memset(buf, 0, sizeof(struct pixel));
+        buf[0].a = 0xFF;
+        if (h.width * h.height > 1) memset(buf + 1, 0xFF, sizeof(struct pixel));
+        
+        /* BMP reader: every line padded to 32 bits, then with alpha */
+        for (bpp = 24; bpp <= 32; bpp += 8) {
+            if (bpp == 32) {
+                for (i = 0; i < h.width * h.height; i++) buf[i].a = rand() & 0xFF;
+            }
+            
+            tests++;
+            back = NULL;
+            
+            if (! write_bmp(tmp_bmp, buf, h.width, h.height, bpp)
+                || (back = read_bmp(tmp_bmp, &h2)) == NULL
+                || h2.width != h.width || h2.height != h.height
+                || memcmp(back, buf, h.width * h.height * sizeof(struct pixel)) != 0) {
+                printf("FAIL read %ux%u %d bit BMP\n", h.width, h.height, bpp);
+                failed++;
+            }
+            
+            free(back);
+        }
+        
+        for (f = 0; f < NUM_PIXFMTS && ok; f++) {
+            memset(&t, 0, sizeof(t));
+            t.threshold = 128;
+            t.num_outputs = 2;
+            t.outputs[0].format = FORMAT_RAW;
+            t.outputs[0].pixfmt = &pixfmts[f];
+            t.outputs[0].file = tmp_raw;
+            t.outputs[1].format = FORMAT_CARRAY;
+            t.outputs[1].pixfmt = &pixfmts[f];
+            t.outputs[1].file = tmp_c;
+            t.outputs[1].arrayname = "selftest";
+            
+            if (! create_outputs(buf, &t, &h)) {
+                printf("FAIL %s %ux%u: no output\n", pixfmts[f].name, h.width, h.height);
+                failed++;
+                continue;
+            }
+            
+            tests++;
+            sprintf(what, "%s %ux%u raw", pixfmts[f].name, h.width, h.height);
+            exp_len = ref_pack(&pixfmts[f], buf, &h, exp, &t);
+            if (! selftest_compare(tmp_raw, exp, exp_len, what)) failed++;
+            
+            /* the original functions for the original formats */
+            sprintf(name, "%d", pixfmts[f].bpp);
+            
+            if (find_pixfmt(name) == &pixfmts[f] && pixfmts[f].bpp >= 8 && pixfmts[f].bpp <= 24) {
+                fp = fopen(tmp_ref, "wb");
+                
+                if (fp == NULL) {
+                    printf("Failed open output file %s\n", tmp_ref);
+                    ok = 0;
+                    break;
+                }
+                
+                ref_create(fp, 0, pixfmts[f].bpp, buf, &h, "selftest");
+                fclose(fp);
+                
+                tests++;
+                ref_c = read_file(tmp_ref, &ref_len);
+                sprintf(what, "%s %ux%u original raw", pixfmts[f].name, h.width, h.height);
+                if (ref_c == NULL || ! selftest_compare(tmp_raw, ref_c, ref_len, what)) failed++;
+                free(ref_c);
+                
+                fp = fopen(tmp_ref, "w");
+                
+                if (fp == NULL) {
+                    printf("Failed open output file %s\n", tmp_ref);
+                    ok = 0;
+                    break;
+                }
+                
+                ref_create(fp, 1, pixfmts[f].bpp, buf, &h, "selftest");
+                fclose(fp);
+                
+                tests++;
+                ref_c = read_file(tmp_ref, &ref_len);
+                sprintf(what, "%s %ux%u original carray", pixfmts[f].name, h.width, h.height);
+                if (ref_c == NULL || ! selftest_compare(tmp_c, ref_c, ref_len, what)) failed++;
+                free(ref_c);
+            }
+            
+            /* unpacked pixels pack to the same bytes, except for the lossy YUV */
+            if (strchr(pixfmts[f].order, 'u') == NULL) {
+                tests++;
+                unp = NULL;
+                back = NULL;
+                ref_c = read_file(tmp_c, &ref_len);
+                
+                if (ref_c != NULL) {
+                    ref_c[ref_len] = '\0';
+                    unp = parse_carray((char *)ref_c, &ref_len, &h2, &uf, &stride);
+                }
+                
+                if (unp != NULL && uf == &pixfmts[f] && h2.width == h.width && h2.height == h.height) {
+                    back = unpack_image(unp, ref_len, uf, &h2, 0, 0, 0);
+                }
+                
+                if (back == NULL || ref_pack(&pixfmts[f], back, &h, repack, &t) != exp_len
+                    || memcmp(repack, exp, exp_len) != 0) {
+                    printf("FAIL %s %ux%u unpack\n", pixfmts[f].name, h.width, h.height);
+                    failed++;
+                }
+                
+                free(back);
+                free(unp);
+                free(ref_c);
+            }
+            
+            /* the lookup table kernels against correcting the pixels first */
+            t.gamma[0] = 2.2;
+            t.gamma[1] = 0.45;
+            t.gamma[2] = 1.0;
+            t.round = 1;
+            lo.pixfmt = &pixfmts[f];
+            
+            if (! build_lut(&lo, &t) || ! create_outputs(buf, &t, &h)) {
+                printf("FAIL %s %ux%u: no corrected output\n", pixfmts[f].name, h.width, h.height);
+                failed++;
+                continue;
+            }
+            
+            for (i = 0; i < h.width * h.height; i++) {
+                cor[i].r = lo.lut[LUT_r][buf[i].r];
+                cor[i].g = lo.lut[LUT_g][buf[i].g];
+                cor[i].b = lo.lut[LUT_b][buf[i].b];
+                cor[i].a = lo.lut[LUT_a][buf[i].a];
+            }
+            
+            free(lo.lut);
+            
+            tests++;
+            sprintf(what, "%s %ux%u gamma", pixfmts[f].name, h.width, h.height);
+            exp_len = ref_pack(&pixfmts[f], cor, &h, exp, &t);
+            if (! selftest_compare(tmp_raw, exp, exp_len, what)) failed++;
+        }
+        
+        free(buf);
+        free(cor);
+        free(exp);
+        free(repack);
+    }
+    
+    remove(tmp_bmp);
+    remove(tmp_raw);
+    remove(tmp_c);
+    remove(tmp_ref);
+    
+    if (! ok) return 0;
+    
+    printf("%d of %d tests passed\n", tests - failed, tests);
+    
+    return failed == 0 && selftest_throughput(o);
+}
+
+/* Parse an output specification <format>:<bpp/pixfmt>:<file>[:<array name>]
+ *
+ * Arguments:   spec:    output specification string
+ *              out:     pointer to output structure to save it in
+ *
+ * Return:      0 if a parse error happened
+ */
+int parse_output(char *spec, struct output *out)
+{
+    char *copy, *pixfmt, *file, *name;
+    
+    copy = malloc(strlen(spec) + 1);
+    
+    if (copy == NULL) {
+        printf("Memory allocation failed (7)");
+        return 0;
+    }
+    
+    strcpy(copy, spec);
+    
+    pixfmt = strchr(copy, ':');
+    file = (pixfmt != NULL) ? strchr(pixfmt + 1, ':') : NULL;
+    
+    if (file == NULL) {
+        free(copy);
+        return 0;
+    }
+    
+    *pixfmt++ = '\0';
+    *file++ = '\0';
+    
+    if (strcmp(copy, "carray") == 0) {
+        out->format = FORMAT_CARRAY;
+    } else if (strcmp(copy, "raw") == 0) {
+        out->format = FORMAT_RAW;
+    } else {
+        printf("'%s' is an invalid format\n", copy);
+        free(copy);
+        return 0;
+    }
+    
+    out->pixfmt = find_pixfmt(pixfmt);
+    
+    if (out->pixfmt == NULL) {
+        printf("'%s' is an invalid bpp value or pixel format\n", pixfmt);
+        free(copy);
+        return 0;
+    }
+    
+    /* the file name itself may contain a colon (C:\...), only split off
+     * the array name if what follows the last colon is a C identifier.
+     */
+    out->arrayname = NULL;
+    name = strrchr(file, ':');
+    
+    if (name != NULL && is_identifier(name + 1)) {
+        *name++ = '\0';
+        out->arrayname = name;
+    }
+    
+    if (*file == '\0') {
+        free(copy);
+        return 0;
+    }
+    
+    out->file = file;
+    
+    return 1;
+}
+
+/* Check if a string is a valid C identifier
+ *
+ * Arguments:   s:       string to check
+ *
+ * Return:      1 if s is a valid C identifier
+ */
+int is_identifier(char *s)
+{
+    if (*s == '\0' || isdigit((unsigned char)*s)) return 0;
+    
+    for (; *s != '\0'; s++) {
+        if (! isalnum((unsigned char)*s) && *s != '_') return 0;
+    }
+    
+    return 1;
+}
+
+/* Parse and save the command line options
+ * 
+ * Arguments:   argc:    number of arguments (including file name!)
+ *              argv:    array of pointers to strings
+ *              opts:    pointer to options structure to save the options     
+ * 
+ * Return:      0 if a parse error happened
+ */
+int parse_opts(int argc, char* argv[], struct options *opts)
+{
+    int i=1;
+    struct output *out;
+    struct pixfmt *pixfmt;
+    struct stat st;
+    char *end;
+    
+    while (i < argc) {
+        
+        /* check for input file parameter */
+        if (strcmp(argv[i], "-if") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-if missing file name\n");
+                printf("usage: -if <filename>\n");
+                return 0;
+            }
+            opts->input_file = argv[i+1];
+            i += 2; 
+        } 
+        /* check for output file parameter */
+        else if (strcmp(argv[i], "-of") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-of missing file name\n");
+                printf("usage: -of <filename>\n");
+                return 0;
+            }
+            opts->output_file = argv[i+1];
+            i += 2; 
+        } 
+        /* check for format parameter */
+        else if (strcmp(argv[i], "-format") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-format missing format type\n");
+                printf("usage: -format <carray/raw>\n");
+                return 0;
+            }
+            
+            if (strcmp(argv[i+1], "carray") == 0) {
+                opts->format = FORMAT_CARRAY;
+            } else if (strcmp(argv[i+1], "raw") == 0) {
+                opts->format = FORMAT_RAW;
+            } else {
+                printf("'%s' is an invalid format\n",argv[i+1]);
+                printf("usage: -format <carray/raw>\n");
+            }
+            i += 2;  
+        } 
+        /* check for bits per pixel parameter */
+        else if (strcmp(argv[i], "-bpp") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-bpp missing number\n");
+                printf("usage: -bpp <1/2/4/8/12/16/24/32>\n");
+                return 0;
+            }
+            
+            pixfmt = find_pixfmt(argv[i+1]);
+            
+            if (pixfmt == NULL || strcmp(argv[i+1], pixfmt->name) == 0) {
+                printf("'%s' is an invalid bpp value\n",argv[i+1]);
+                printf("usage: -bpp <1/2/4/8/12/16/24/32>\n");
+                return 0;
+            }
+            
+            opts->bpp = pixfmt->bpp;
+            i += 2;  
+        }
+        /* check for pixel format parameter */
+        else if (strcmp(argv[i], "-pixfmt") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-pixfmt missing pixel format\n");
+                printf("usage: -pixfmt <pixel format>, see -help\n");
+                return 0;
+            }
+            
+            if (find_pixfmt(argv[i+1]) == NULL) {
+                printf("'%s' is an invalid pixel format\n",argv[i+1]);
+                printf("usage: -pixfmt <pixel format>, see -help\n");
+                return 0;
+            }
+            
+            opts->pixfmt = argv[i+1];
+            i += 2;  
+        }
+        /* check for additional output parameter */
+        else if (strcmp(argv[i], "-out") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-out missing output specification\n");
+                printf("usage: -out <carray/raw>:<bpp/pixel format>:<filename>[:<array name>]\n");
+                return 0;
+            }
+            
+            if (opts->num_outputs == MAX_OUTPUTS) {
+                printf("too many outputs (max %d)\n", MAX_OUTPUTS);
+                return 0;
+            }
+            
+            if (! parse_output(argv[i+1], &opts->outputs[opts->num_outputs])) {
+                printf("'%s' is an invalid output specification\n", argv[i+1]);
+                printf("usage: -out <carray/raw>:<bpp/pixel format>:<filename>[:<array name>]\n");
+                return 0;
+            }
+            
+            opts->num_outputs++;
+            i += 2;
+        }
+        /* check for sequence parameter */
+        else if (strcmp(argv[i], "-seq") == 0) {
+            
+            if ((i+1) >= argc || ! is_sequence_pattern(argv[i+1])) {
+                printf("-seq missing or invalid file name pattern\n");
+                printf("usage: -seq <filename pattern, like frame%%03d.bmp>\n");
+                return 0;
+            }
+            
+            opts->sequence = argv[i+1];
+            i += 2;
+        }
+        /* check for frames parameter */
+        else if (strcmp(argv[i], "-frames") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 1 || atoi(argv[i+1]) > 0xFFFF) {
+                printf("-frames missing or invalid number\n");
+                printf("usage: -frames <1..65535>\n");
+                return 0;
+            }
+            
+            opts->frames = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for first frame parameter */
+        else if (strcmp(argv[i], "-firstframe") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-firstframe missing number\n");
+                printf("usage: -firstframe <number>\n");
+                return 0;
+            }
+            
+            opts->first_frame = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for keyframe interval parameter */
+        else if (strcmp(argv[i], "-keyframe") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 0 || atoi(argv[i+1]) > 0xFFFF) {
+                printf("-keyframe missing or invalid interval\n");
+                printf("usage: -keyframe <interval, 0 for first frame only>\n");
+                return 0;
+            }
+            
+            opts->keyframe = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for threshold parameter */
+        else if (strcmp(argv[i], "-threshold") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 1 || atoi(argv[i+1]) > 255) {
+                printf("-threshold missing or invalid value\n");
+                printf("usage: -threshold <1..255>\n");
+                return 0;
+            }
+            
+            opts->threshold = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for dither parameter */
+        else if (strcmp(argv[i], "-dither") == 0) {
+            opts->dither = 1;
+            i++;
+        }
+        /* check for premultiply parameter */
+        else if (strcmp(argv[i], "-premultiply") == 0) {
+            opts->premultiply = 1;
+            i++;
+        }
+        /* check for gamma parameter */
+        else if (strcmp(argv[i], "-gamma") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-gamma missing value\n");
+                printf("usage: -gamma <gamma> or -gamma <red>,<green>,<blue>\n");
+                return 0;
+            }
+            
+            opts->gamma[0] = strtod(argv[i+1], &end);
+            opts->gamma[1] = opts->gamma[2] = opts->gamma[0];
+            
+            /* per channel: red, green and blue, not two values */
+            if (*end == ',') {
+                opts->gamma[1] = strtod(end + 1, &end);
+                opts->gamma[2] = (*end == ',') ? strtod(end + 1, &end) : 0;
+            }
+            
+            if (*end != '\0' || opts->gamma[0] <= 0 || opts->gamma[1] <= 0 || opts->gamma[2] <= 0) {
+                printf("-gamma invalid value\n");
+                printf("usage: -gamma <gamma> or -gamma <red>,<green>,<blue>\n");
+                return 0;
+            }
+            
+            i += 2;
+        }
+        /* check for lookup table parameter */
+        else if (strcmp(argv[i], "-lut") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-lut missing file name\n");
+                printf("usage: -lut <filename>\n");
+                return 0;
+            }
+            
+            opts->lut_file = argv[i+1];
+            i += 2;
+        }
+        /* check for round parameter */
+        else if (strcmp(argv[i], "-round") == 0) {
+            opts->round = 1;
+            i++;
+        }
+        /* check for automatic pixel format parameter */
+        else if (strcmp(argv[i], "-auto") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-auto missing limit\n");
+                printf("usage: -auto <psnr:<dB>/maxerror:<0..255>/bytes:<bytes>>\n");
+                return 0;
+            }
+            
+            if (strncmp(argv[i+1], "psnr:", 5) == 0) {
+                opts->auto_mode = AUTO_PSNR;
+            } else if (strncmp(argv[i+1], "maxerror:", 9) == 0) {
+                opts->auto_mode = AUTO_MAXERROR;
+            } else if (strncmp(argv[i+1], "bytes:", 6) == 0) {
+                opts->auto_mode = AUTO_BYTES;
+            } else {
+                opts->auto_mode = UNSET;
+            }
+            
+            if (opts->auto_mode != UNSET) {
+                opts->auto_limit = strtod(strchr(argv[i+1], ':') + 1, &end);
+            }
+            
+            if (opts->auto_mode == UNSET || *end != '\0' || end == strchr(argv[i+1], ':') + 1
+                || opts->auto_limit < 0) {
+                printf("-auto invalid limit\n");
+                printf("usage: -auto <psnr:<dB>/maxerror:<0..255>/bytes:<bytes>>\n");
+                return 0;
+            }
+            
+            i += 2;
+        }
+        /* check for layout parameter */
+        else if (strcmp(argv[i], "-layout") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-layout missing layout\n");
+                printf("usage: -layout <rows/tiled:<width>x<height>/morton:<width>x<height>>\n");
+                return 0;
+            }
+            
+            if (strcmp(argv[i+1], "rows") == 0) {
+                opts->layout = UNSET;
+            } else if ((strncmp(argv[i+1], "tiled:", 6) != 0 && strncmp(argv[i+1], "morton:", 7) != 0)
+                       || sscanf(strchr(argv[i+1], ':') + 1, "%ux%u", &opts->tile_width, &opts->tile_height) != 2
+                       || opts->tile_width < 1 || opts->tile_width > 256
+                       || opts->tile_height < 1 || opts->tile_height > 256) {
+                printf("-layout invalid layout or tile size\n");
+                printf("usage: -layout <rows/tiled:<width>x<height>/morton:<width>x<height>>\n");
+                return 0;
+            } else {
+                opts->layout = (argv[i+1][0] == 't') ? LAYOUT_TILED : LAYOUT_MORTON;
+            }
+            
+            i += 2;
+        }
+        /* check for row stride parameter */
+        else if (strcmp(argv[i], "-stride") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 1 || atoi(argv[i+1]) > 4096) {
+                printf("-stride missing or invalid number of bytes\n");
+                printf("usage: -stride <1..4096>\n");
+                return 0;
+            }
             
-            b3 = pix->g;
-            b3 &= ~0x0F;
-            b3 |= (pix->b >> 4);
+            opts->stride = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for array alignment parameter */
+        else if (strcmp(argv[i], "-arrayalign") == 0) {
             
-            fwrite(&b1, sizeof(unsigned char), 1, fp);
-            fwrite(&b2, sizeof(unsigned char), 1, fp);
-            fwrite(&b3, sizeof(unsigned char), 1, fp);
+            if ((i+1) >= argc || atoi(argv[i+1]) < 1 || atoi(argv[i+1]) > 4096
+                || (atoi(argv[i+1]) & (atoi(argv[i+1]) - 1)) != 0) {
+                printf("-arrayalign missing or invalid alignment\n");
+                printf("usage: -arrayalign <power of 2, up to 4096>\n");
+                return 0;
+            }
             
-        } else {
-            fwrite(&b1, sizeof(unsigned char), 1, fp);
-            fwrite(&b2, sizeof(unsigned char), 1, fp);
+            opts->array_align = atoi(argv[i+1]);
+            i += 2;
         }
-        
-        pix++;        
-    }
-    
-    fclose(fp);
-    
-    return 1;
-}
-
-/* Save the contents of the pixel buffer to a file
- * as RAW with 16 bits per pixel.
- * Pixel format: RRRRRGGG GGGBBBBB 
- * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
- *              o:       pointer to options structure   
- * 
- * Return:      0 if failed to create output file
- */
-int create_raw_16bit(struct pixel *buf, int pixels, struct options *o) {
-    
-    FILE *fp;
-    int i;
-    unsigned char b1, b2;
-    struct pixel *pix = buf;
-    
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "ab+");
-    } else {
-        fp = fopen(o->output_file, "wb+");
-    }
-    
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
-    }
-    
-    /* write array data */
-    for (i=0; i< pixels; i++) {
-        
-        b1 = pix->r;        
-        b1 &= ~(0xFF >> 5); 
-        b1 |= (pix->g >> 5);
-        
-        b2 |= (pix->g << 3);
-        b2 &= ~(0xFF >> 3);
-        b2 |= (pix->b >> 3);
-        
-        fwrite(&b1, sizeof(unsigned char), 1, fp);
-        fwrite(&b2, sizeof(unsigned char), 1, fp);
-          
-        pix++;        
-    }
-
-    fclose(fp);
-    
-    return 1;
-}
-
-/* Save the contents of the pixel buffer to a file
- * as RAW with 24 bits per pixel.
- * Pixel format: RRRRRRRR GGGGGGGG BBBBBBBB 
- * 
- * Arguments:   buf:     pointer to array of pixel structures
- *              pixels:  number of pixels in buffer
- *              o:       pointer to options structure   
- * 
- * Return:      0 if failed to create output file
- */
-int create_raw_24bit(struct pixel *buf, int pixels, struct options *o) {
-    
-    FILE *fp;
-    int i;
-    struct pixel *pix = buf;
-    
-    /* check if we append or overwrite if file exists */
-    if (o->append == APPEND) {
-        fp = fopen(o->output_file, "ab+");
-    } else {
-        fp = fopen(o->output_file, "wb+");
-    }
-    
-    /* succesfully opened? */
-    if (fp == NULL) {
-        printf("Failed open output file %s\n", o->output_file);
-        return 0;
-    }
-    
-    /* write array data */
-    for (i=0; i< pixels; i++) {
-        
-        fwrite(&pix->r, sizeof(unsigned char), 1, fp);
-        fwrite(&pix->g, sizeof(unsigned char), 1, fp);
-        fwrite(&pix->b, sizeof(unsigned char), 1, fp);      
-          
-        pix++;   
-    }
-
-    fclose(fp);
-    
-    return 1;
-}
-
-/* Parse and save the command line options
- * 
- * Arguments:   argc:    number of arguments (including file name!)
- *              argv:    array of pointers to strings
- *              opts:    pointer to options structure to save the options     
- * 
- * Return:      0 if a parse error happened
- */
-int parse_opts(int argc, char* argv[], struct options *opts)
-{
-    int i=1;
-    
-    while (i < argc) {
-        
-        /* check for input file parameter */
-        if (strcmp(argv[i], "-if") == 0) {
+        /* check for const parameter */
+        else if (strcmp(argv[i], "-const") == 0) {
+            opts->constant = 1;
+            i++;
+        }
+        /* check for section parameter */
+        else if (strcmp(argv[i], "-section") == 0) {
+            
+            if ((i+1) >= argc || strchr(argv[i+1], '"') != NULL
+                || (strchr(argv[i+1], '%') != NULL && ! is_sequence_pattern(argv[i+1]))) {
+                printf("-section missing or invalid section name\n");
+                printf("usage: -section <name, %%d is replaced by the bank or shard number>\n");
+                return 0;
+            }
+            
+            opts->section = argv[i+1];
+            i += 2;
+        }
+        /* check for bank size parameter */
+        else if (strcmp(argv[i], "-banksize") == 0) {
+            
+            if ((i+1) >= argc || atol(argv[i+1]) < 1) {
+                printf("-banksize missing or invalid number of bytes\n");
+                printf("usage: -banksize <bytes>\n");
+                return 0;
+            }
+            
+            opts->bank_size = atol(argv[i+1]);
+            i += 2;
+        }
+        /* check for shards parameter */
+        else if (strcmp(argv[i], "-shards") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 2 || atoi(argv[i+1]) > MAX_SHARDS) {
+                printf("-shards missing or invalid number of files\n");
+                printf("usage: -shards <2..%d>\n", MAX_SHARDS);
+                return 0;
+            }
+            
+            opts->shards = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for font parameter */
+        else if (strcmp(argv[i], "-font") == 0) {
+            
+            if ((i+1) >= argc
+                || sscanf(argv[i+1], "%ux%u", &opts->cell_width, &opts->cell_height) != 2
+                || opts->cell_width < 1 || opts->cell_width > 255
+                || opts->cell_height < 1 || opts->cell_height > 255) {
+                printf("-font missing or invalid cell size\n");
+                printf("usage: -font <1..255>x<1..255>\n");
+                return 0;
+            }
+            
+            opts->font = argv[i+1];
+            i += 2;
+        }
+        /* check for character range parameter */
+        else if (strcmp(argv[i], "-chars") == 0) {
             
             if ((i+1) >= argc) {
-                printf("-if missing file name\n");
-                printf("usage: -if <filename>\n");
+                printf("-chars missing character range\n");
+                printf("usage: -chars <first>[-<last>]\n");
+                return 0;
+            }
+            
+            opts->first_char = strtol(argv[i+1], &end, 0);
+            opts->last_char = (*end == '-') ? strtol(end + 1, &end, 0) : opts->first_char;
+            
+            if (*end != '\0' || opts->first_char < 0 || opts->last_char < opts->first_char
+                || opts->last_char > MAX_CHAR) {
+                printf("-chars invalid character range\n");
+                printf("usage: -chars <first>[-<last>], 0..%d\n", MAX_CHAR);
+                return 0;
+            }
+            
+            opts->chars = 1;
+            
+            i += 2;
+        }
+        /* check for glyph coverage bits parameter */
+        else if (strcmp(argv[i], "-glyphbits") == 0) {
+            
+            if ((i+1) >= argc || (atoi(argv[i+1]) != 1 && atoi(argv[i+1]) != 2 && atoi(argv[i+1]) != 4)) {
+                printf("-glyphbits missing or invalid number\n");
+                printf("usage: -glyphbits <1/2/4>\n");
                 return 0;
             }
-            opts->input_file = argv[i+1];
-            i += 2; 
-        } 
-        /* check for output file parameter */
-        else if (strcmp(argv[i], "-of") == 0) {
+            
+            opts->glyph_bits = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for proportional font parameter */
+        else if (strcmp(argv[i], "-proportional") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 0 || atoi(argv[i+1]) > 255) {
+                printf("-proportional missing or invalid spacing\n");
+                printf("usage: -proportional <spacing in pixels>\n");
+                return 0;
+            }
+            
+            opts->proportional = 1;
+            opts->spacing = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for container parameter */
+        else if (strcmp(argv[i], "-container") == 0) {
             
             if ((i+1) >= argc) {
-                printf("-of missing file name\n");
-                printf("usage: -of <filename>\n");
+                printf("-container missing file name\n");
+                printf("usage: -container <filename>\n");
                 return 0;
             }
-            opts->output_file = argv[i+1];
-            i += 2; 
-        } 
-        /* check for format parameter */
-        else if (strcmp(argv[i], "-format") == 0) {
+            
+            opts->container = argv[i+1];
+            i += 2;
+        }
+        /* check for container alignment parameter */
+        else if (strcmp(argv[i], "-align") == 0) {
+            
+            if ((i+1) >= argc || atoi(argv[i+1]) < 1 || atoi(argv[i+1]) > 4096
+                || (atoi(argv[i+1]) & (atoi(argv[i+1]) - 1)) != 0) {
+                printf("-align missing or invalid alignment\n");
+                printf("usage: -align <1/2/4/.../4096>\n");
+                return 0;
+            }
+            
+            opts->align = atoi(argv[i+1]);
+            i += 2;
+        }
+        /* check for selftest parameter */
+        else if (strcmp(argv[i], "-selftest") == 0) {
+            opts->selftest = 1;
+            i++;
+        }
+        /* check for baseline parameter */
+        else if (strcmp(argv[i], "-baseline") == 0) {
             
             if ((i+1) >= argc) {
-                printf("-format missing format type\n");
-                printf("usage: -format <carray/raw>\n");
+                printf("-baseline missing file name\n");
+                printf("usage: -baseline <filename>\n");
                 return 0;
             }
             
-            if (strcmp(argv[i+1], "carray") == 0) {
-                opts->format = FORMAT_CARRAY;
-            } else if (strcmp(argv[i+1], "raw") == 0) {
-                opts->format = FORMAT_RAW;
-            } else {
-                printf("'%s' is an invalid format\n",argv[i+1]);
-                printf("usage: -format <carray/raw>\n");
+            opts->baseline = argv[i+1];
+            i += 2;
+        }
+        /* check for save baseline parameter */
+        else if (strcmp(argv[i], "-savebaseline") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-savebaseline missing file name\n");
+                printf("usage: -savebaseline <filename>\n");
+                return 0;
             }
-            i += 2;  
-        } 
-        /* check for bits per pixel parameter */
-        else if (strcmp(argv[i], "-bpp") == 0) {
+            
+            opts->save_baseline = argv[i+1];
+            i += 2;
+        }
+        /* check for check container parameter */
+        else if (strcmp(argv[i], "-check") == 0) {
             
             if ((i+1) >= argc) {
-                printf("-bpp missing number\n");
-                printf("usage: -bpp <8/12>\n");
+                printf("-check missing file name\n");
+                printf("usage: -check <filename>\n");
                 return 0;
             }
             
-            if (strcmp(argv[i+1], "8") == 0) {
-                opts->bpp = 8;
-            } else if (strcmp(argv[i+1], "12") == 0) {
-                opts->bpp = 12;
-            } else if (strcmp(argv[i+1], "16") == 0) {
-                opts->bpp = 16;
-            } else if (strcmp(argv[i+1], "24") == 0) {
-                opts->bpp = 24;
-            } else {
-                printf("'%s' is an invalid bpp value\n",argv[i+1]);
-                printf("usage: -bpp <8/12/16/24>\n");
+            opts->check = argv[i+1];
+            i += 2;
+        }
+        /* check for scan parameter */
+        else if (strcmp(argv[i], "-scan") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-scan missing directory\n");
+                printf("usage: -scan <directory>\n");
                 return 0;
             }
-            i += 2;  
+            
+            opts->scan = argv[i+1];
+            i += 2;
+        }
+        /* check for watch parameter */
+        else if (strcmp(argv[i], "-watch") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-watch missing file or directory\n");
+                printf("usage: -watch <BMP file or directory>\n");
+                return 0;
+            }
+            
+            opts->watch = argv[i+1];
+            i += 2;
+        }
+        /* check for unpack parameter */
+        else if (strcmp(argv[i], "-unpack") == 0) {
+            
+            if ((i+1) >= argc) {
+                printf("-unpack missing file name\n");
+                printf("usage: -unpack <raw or C array file>\n");
+                return 0;
+            }
+            
+            opts->unpack = argv[i+1];
+            i += 2;
+        }
+        /* check for image size parameter */
+        else if (strcmp(argv[i], "-size") == 0) {
+            
+            if ((i+1) >= argc
+                || sscanf(argv[i+1], "%ux%u", &opts->unpack_width, &opts->unpack_height) != 2
+                || opts->unpack_width == 0 || opts->unpack_height == 0) {
+                printf("-size missing or invalid size\n");
+                printf("usage: -size <width>x<height>\n");
+                return 0;
+            }
+            
+            i += 2;
+        }
+        /* check for json parameter */
+        else if (strcmp(argv[i], "-json") == 0) {
+            opts->json = 1;
+            i++;
         }
         /* check for arrayname parameter */
         else if (strcmp(argv[i], "-arrayname") == 0) {
@@ -944,8 +5924,78 @@ int parse_opts(int argc, char* argv[], struct options *opts)
     
     /* give default values for some unused options */
     
+    /* checking a container, scanning, unpacking or selftest needs no other options */
+    if (opts->check != NULL || opts->selftest || opts->scan != NULL || opts->unpack != NULL) {
+        if (opts->threshold == UNSET) opts->threshold = 128;
+        return 1;
+    }
+    
+    if (opts->auto_mode != UNSET && (opts->sequence != NULL || opts->container != NULL || opts->font != NULL)) {
+        printf("-auto chooses the pixel format of a single image, not of -seq, -container or -font\n");
+        return 0;
+    }
+    
+    if (opts->layout != UNSET && (opts->sequence != NULL || opts->container != NULL || opts->font != NULL)) {
+        printf("-layout is only for single images, not for -seq, -container or -font\n");
+        return 0;
+    }
+    
+    if (opts->container != NULL && (opts->dither || opts->stride > 0 || opts->bank_size > 0
+        || opts->num_outputs > 0)) {
+        printf("-container writes unpadded raw frames of one pixel format, -dither, -stride,\n");
+        printf("-banksize and -out can not be used with it\n");
+        return 0;
+    }
+    
+    if (opts->layout != UNSET && (opts->stride > 0 || opts->bank_size > 0)) {
+        printf("-layout can not be combined with -stride or -banksize, tiles have no rows\n");
+        return 0;
+    }
+    
+    if (opts->shards > 0 && (opts->sequence != NULL || opts->container != NULL || opts->font != NULL
+        || opts->bank_size > 0 || opts->append == APPEND)) {
+        printf("-shards splits the C array of a single image, not of -seq, -container or\n");
+        printf("-font, and can not be combined with -banksize or -append\n");
+        return 0;
+    }
+    
+    if (opts->shards > 0) {
+        for (i = 0; i < opts->num_outputs && opts->outputs[i].format != FORMAT_RAW; i++);
+        
+        if (i < opts->num_outputs || (opts->format == FORMAT_RAW && (opts->num_outputs == 0 || opts->output_file != NULL))) {
+            printf("-shards splits a C array, a raw output can not be split\n");
+            return 0;
+        }
+    }
+    
+    /* -watch: the input image, or every image in a directory tree with
+     * one output next to it
+     */
+    if (opts->watch != NULL) {
+        if (stat(opts->watch, &st) != 0) {
+            printf("Can not watch %s\n", opts->watch);
+            return 0;
+        }
+        
+        opts->watch_dir = S_ISDIR(st.st_mode);
+        
+        if (opts->sequence != NULL || (opts->watch_dir && (opts->container != NULL || opts->font != NULL
+            || opts->num_outputs > 0 || opts->output_file != NULL || opts->arrayname != NULL))) {
+            printf("-watch <directory> writes one output next to every image, -out, -of,\n");
+            printf("-arrayname, -container and -font can not be used with it, -seq never\n");
+            return 0;
+        }
+        
+        opts->input_file = opts->watch;
+    }
+    
+    if (opts->sequence != NULL && opts->frames == UNSET) {
+        printf("-seq needs the number of frames (-frames)\n");
+        return 0;
+    }
+    
     /* default input file: bitmap.bmp */
-    if (opts->input_file == NULL) {
+    if (opts->input_file == NULL && opts->sequence == NULL) {
         
         opts->input_file = malloc(sizeof(char)*11);
         
@@ -958,6 +6008,48 @@ int parse_opts(int argc, char* argv[], struct options *opts)
         printf("No input file specified: using %s\n", opts->input_file);
     }
     
+    /* default font characters: printable ASCII */
+    if (opts->font != NULL && ! opts->chars) {
+        opts->first_char = 32;
+        opts->last_char = 126;
+    }
+    
+    /* default 1 bit threshold: 128 */
+    if (opts->threshold == UNSET) {
+        opts->threshold = 128;
+    }
+    
+    /* default container alignment: 4 bytes */
+    if (opts->align == UNSET) {
+        opts->align = 4;
+    }
+    
+    /* a container has no other outputs, only a pixel format */
+    if (opts->container != NULL) {
+        if (opts->bpp == UNSET && opts->pixfmt == NULL) {
+            opts->bpp = 12;
+            printf("No bpp specified: using %d bpp\n", opts->bpp);
+        }
+        return 1;
+    }
+    
+    /* -out outputs without array name use -arrayname or bitmap */
+    for (i = 0; i < opts->num_outputs; i++) {
+        if (opts->outputs[i].arrayname == NULL) {
+            opts->outputs[i].arrayname = (opts->arrayname != NULL) ? opts->arrayname : "bitmap";
+        }
+    }
+    
+    /* -out outputs replace the -format/-bpp/-of output unless -of is given */
+    if (opts->num_outputs > 0 && opts->output_file == NULL) {
+        return 1;
+    }
+    
+    if (opts->num_outputs == MAX_OUTPUTS) {
+        printf("too many outputs (max %d)\n", MAX_OUTPUTS);
+        return 0;
+    }
+    
     /* default format: c array */
     if (opts->format == UNSET) {
         opts->format = FORMAT_CARRAY;
@@ -986,13 +6078,13 @@ int parse_opts(int argc, char* argv[], struct options *opts)
             
             sprintf(opts->output_file, "bitmap.raw");
         }
-        printf("No output file specified: using %s\n", opts->output_file);
+        if (! opts->watch_dir) printf("No output file specified: using %s\n", opts->output_file);
     }
     
-    /* default bpp: 12 bit */
-    if (opts->bpp == UNSET) {
+    /* default bpp: 12 bit, until -auto has seen the image */
+    if (opts->bpp == UNSET && opts->pixfmt == NULL) {
         opts->bpp = 12;
-        printf("No bpp specified: using %d bpp\n", opts->bpp);
+        if (opts->auto_mode == UNSET) printf("No bpp specified: using %d bpp\n", opts->bpp);
     }
     
     /* default C array name: bitmap */
@@ -1005,9 +6097,16 @@ int parse_opts(int argc, char* argv[], struct options *opts)
         }
         
         sprintf(opts->arrayname, "bitmap");
-        printf("No C array name specified: using %s[]\n", opts->arrayname);
+        if (! opts->watch_dir) printf("No C array name specified: using %s[]\n", opts->arrayname);
     }
     
+    /* add the -format/-bpp/-of output to the outputs */
+    out = &opts->outputs[opts->num_outputs++];
+    out->format = opts->format;
+    out->pixfmt = default_pixfmt(opts);
+    out->file = opts->output_file;
+    out->arrayname = opts->arrayname;
+    
     return 1;
 }
 
@@ -1045,23 +6144,42 @@ void print_header(struct bmp_header *h)
  */
 void print_options(struct options *o)
 {
+    int i;
+    struct output *out;
+    
     printf("===== OPTIONS  =====\n");
-    printf("Input file: %s\n", o->input_file);
-    printf("Ouput file: %s\n", o->output_file);
     
-    if (o->format == FORMAT_CARRAY)
-        printf("Format: C array\n");
-    else if (o->format == FORMAT_RAW)
-        printf("Format: Raw\n");
+    if (o->sequence != NULL)
+        printf("Sequence: %s, %d frames from %d, keyframe interval %d\n",
+               o->sequence, o->frames, o->first_frame, o->keyframe);
+    else
+        printf("Input file: %s\n", o->input_file);
+    
+    for (i = 0; i < o->num_outputs; i++) {
+        out = &o->outputs[i];
+        
+        printf("Output %d: %s, %s, %s (%d bits per pixel)", i+1, out->file,
+               (out->format == FORMAT_CARRAY) ? "C array" : "Raw",
+               out->pixfmt->name, out->pixfmt->bpp);
+        
+        if (out->format == FORMAT_CARRAY)
+            printf(", array name %s", out->arrayname);
         
-    printf("Bits per pixel: %d\n", o->bpp);
+        printf("\n");
+    }
     
     if (o->append == APPEND)
         printf("Append: yes\n");
     else 
         printf("Append: no\n");
-        
-    printf("Array name: %s\n");
+    
+    if (o->premultiply)
+        printf("Premultiply: yes\n");
+    
+    if (o->auto_mode != UNSET)
+        printf("Auto: %s %g, the output pixel formats are chosen from the image\n",
+               (o->auto_mode == AUTO_PSNR) ? "PSNR" : (o->auto_mode == AUTO_MAXERROR) ? "max error" : "bytes",
+               o->auto_limit);
     
     if (o->verbose == VERBOSE) 
         printf("Verbose: yes\n");
@@ -1079,16 +6197,85 @@ void print_options(struct options *o)
  */
 void print_help() 
 {
-    printf("bmpdump is a utility to convert a 24 bit uncompressed BMP image\ninto other formats.\n\n");
-    printf("currently supported output formats:\nC array (8, 12, 16, 24 bits)\nRAW (8, 12, 16, 24 bits)\n\n");
+    int i;
+    
+    printf("bmpdump is a utility to convert a 24 or 32 bit uncompressed BMP image\ninto other formats.\n\n");
+    printf("currently supported output formats:\nC array (1, 2, 4, 8, 12, 16, 24, 32 bits)\nRAW (1, 2, 4, 8, 12, 16, 24, 32 bits)\n\n");
     printf("usage: bmpdump <parameters>\n\n");
     printf("Parameters:\n");
     printf("-if <file path>                 Input BMP file\n");
     printf("-of <file path>                 Output file\n");
     printf("-append                         Append if output file exists\n");
     printf("-format <carray/raw>            Output format (C array or Raw)\n");       
-    printf("-bpp <8/12/16/24>               Bits per pixel in output file\n");
+    printf("-bpp <1/2/4/8/12/16/24/32>      Bits per pixel in output file\n");
+    printf("-pixfmt <pixel format>          Pixel format in output file, overrides -bpp\n");
     printf("-arrayname <array name>         Array name if output format is C array\n");
+    printf("-out <format>:<bpp/pixel format>:<file path>[:<array name>]\n");
+    printf("                                Additional output, can be given multiple\n");
+    printf("                                times. The image is decoded only once.\n");
+    printf("-seq <file name pattern>        Convert a sequence of frames (frame%%03d.bmp)\n");
+    printf("                                to changed rectangles per frame\n");
+    printf("-frames <number>                Number of frames in the sequence\n");
+    printf("-firstframe <number>            Number of the first frame (default 0)\n");
+    printf("-keyframe <interval>            Write a whole frame every interval frames\n");
+    printf("                                (default 0: only the first frame)\n");
+    printf("-threshold <1..255>             Luminance threshold for 1 bit output (default 128)\n");
+    printf("-dither                         Ordered dithering for 1 bit and gray output\n");
+    printf("-premultiply                    Multiply color with alpha (32 bit input)\n");
+    printf("-const                          Declare the C arrays const\n");
+    printf("-arrayalign <bytes>             Align the C arrays (GCC attribute)\n");
+    printf("-section <name>                 Place the C arrays in a linker section,\n");
+    printf("                                %%d is replaced by the bank or shard\n");
+    printf("                                number\n");
+    printf("-layout tiled:<width>x<height>  Write the image in tiles of this size,\n");
+    printf("                                for tiled framebuffers and 2D engines\n");
+    printf("-layout morton:<width>x<height> Same, pixels in Morton (Z) order in a tile\n");
+    printf("-stride <bytes>                 Pad every row to a multiple of bytes\n");
+    printf("-banksize <bytes>               Split the rows over banks of at most\n");
+    printf("                                this size, one array per bank\n");
+    printf("-shards <number>                Split a C array over at most this number\n");
+    printf("                                of .c files, with a .h file for them\n");
+    printf("-gamma <g>[,<g green>,<g blue>] Raise each channel to the power g (of\n");
+    printf("                                0..1), per channel if three values\n");
+    printf("-lut <file path>                Correction table: 256 red, 256 green and\n");
+    printf("                                256 blue bytes, applied before -gamma\n");
+    printf("-round                          Round channels to the output bits\n");
+    printf("                                instead of truncating them\n");
+    printf("-auto psnr:<dB>                 Use the smallest pixel format with at\n");
+    printf("                                least this PSNR for all outputs\n");
+    printf("-auto maxerror:<0..255>         Same, with at most this channel error\n");
+    printf("-auto bytes:<bytes>             Use the most accurate pixel format\n");
+    printf("                                that fits in this number of bytes\n");
+    printf("-font <width>x<height>          Slice the input image into a font of\n");
+    printf("                                glyphs in cells of this size\n");
+    printf("-chars <first>[-<last>]         Characters in the font (default 32-126)\n");
+    printf("-glyphbits <1/2/4>              Font glyphs as coverage instead of pixels\n");
+    printf("-proportional <spacing>         Proportional font, advance is glyph width\n");
+    printf("                                plus spacing\n");
+    printf("-container <file path>          Write the input image or the -seq frames\n");
+    printf("                                to a container with a frame index\n");
+    printf("-align <bytes>                  Alignment of container frames (default 4)\n");
+    printf("-check <file path>              Check a container and print its index\n");
+    printf("-scan <directory>               Check the headers of all BMP images in a\n");
+    printf("                                directory tree and list their output sizes\n");
+    printf("-json                           Scan report as JSON instead of a table\n");
+    printf("-watch <file/directory path>    Convert the input file, or every BMP image\n");
+    printf("                                in a directory tree to a file next to it,\n");
+    printf("                                again whenever it changes\n");
+    printf("-unpack <file path>             Unpack a raw or C array output to a preview\n");
+    printf("                                BMP (-of, default <file>.bmp), with -if\n");
+    printf("                                compare it with the original image\n");
+    printf("-size <width>x<height>          Image size of a raw -unpack file\n");
+    printf("-selftest                       Check all pixel formats against reference\n");
+    printf("                                code and measure their speed\n");
+    printf("-baseline <file path>           Fail the selftest if a format is much\n");
+    printf("                                slower than in this file\n");
+    printf("-savebaseline <file path>       Save the selftest speeds as baseline\n");
     printf("-verbose                        More verbose\n");
     printf("-help                           Show help\n");
+    printf("\nPixel formats (the first of each bpp is used for -bpp):\n");
+    
+    for (i = 0; i < NUM_PIXFMTS; i++) {
+        printf("%-10s %s\n", pixfmts[i].name, pixfmts[i].layout);
+    }
 }